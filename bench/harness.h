@@ -0,0 +1,214 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace bench
+{
+
+// Resident memory of the process now, in bytes, 0 when not known
+inline size_t current_rss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.WorkingSetSize;
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+        reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+#else
+    // second field of statm, in pages
+    std::ifstream statm("/proc/self/statm");
+    size_t pages{ 0 }, resident{ 0 };
+    if (!(statm >> pages >> resident)) {
+        return 0;
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// -- Resident memory high-water mark over a section of the run
+// ru_maxrss and PeakWorkingSetSize cover the whole process, so they can't
+// tell one model or thread count from the one before. On Linux the kernel
+// mark is restarted through /proc/self/clear_refs and read back from
+// VmHWM; elsewhere (or if clear_refs can't be written) the peak is the
+// largest current RSS passed to sample(), which misses peaks inside a step.
+class RssPeak
+{
+    size_t _sampled{ 0 };
+    bool _kernel{ false };
+
+#if defined(__linux__)
+    static size_t vm_hwm() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                // kilobytes
+                return std::stoull(line.substr(6)) * 1024;
+            }
+        }
+        return 0;
+    }
+#endif
+public:
+    RssPeak() { reset(); }
+
+    void reset() {
+        _sampled = current_rss();
+#if defined(__linux__)
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        _kernel = static_cast<bool>(clear_refs << "5" << std::flush);
+#endif
+    }
+
+    void sample() {
+        _sampled = std::max(_sampled, current_rss());
+    }
+
+    size_t peak() const {
+#if defined(__linux__)
+        if (_kernel) {
+            return std::max(_sampled, vm_hwm());
+        }
+#endif
+        return _sampled;
+    }
+};
+
+// Parameters of one case (batch size, shape, threads), written as they are
+typedef std::vector<std::pair<std::string, long long>> Params;
+
+struct Result
+{
+    std::string name;
+    Params params;
+    int reps;
+    double min_us;
+    double median_us;
+    double mean_us;
+    double stddev_us;
+    // per call, 0 when not known
+    double flops;
+    double bytes;
+};
+
+// -- Microbenchmark runner
+// Every case is called once to warm up, then repeatedly until it ran for
+// min_ms and at least min_reps times. Each call is timed on its own so
+// the minimum and median are reported next to the mean.
+class Suite
+{
+    typedef std::chrono::steady_clock clock;
+
+    std::string _filter;
+    double _min_ms;
+    int _min_reps;
+    std::vector<Result> _results;
+
+    static std::string params_str(const Params& params) {
+        std::string s;
+        for (const auto& [key, value] : params) {
+            s += (s.empty() ? "" : " ") + key + "=" + std::to_string(value);
+        }
+        return s;
+    }
+public:
+    Suite(std::string filter = "", double min_ms = 200.0, int min_reps = 5)
+        : _filter{ std::move(filter) }, _min_ms{ min_ms }, _min_reps{ min_reps } {}
+
+    bool selected(const std::string& name) const {
+        return _filter.empty() || name.find(_filter) != std::string::npos;
+    }
+
+    template<typename F>
+    void run(const std::string& name, const Params& params, double flops,
+        double bytes, F&& f) {
+        if (!selected(name)) {
+            return;
+        }
+        f();
+        std::vector<double> times;
+        double total{ 0.0 };
+        while (total < _min_ms * 1000 || static_cast<int>(times.size()) < _min_reps) {
+            const clock::time_point start = clock::now();
+            f();
+            const double us = std::chrono::duration<double, std::micro>(
+                clock::now() - start).count();
+            times.push_back(us);
+            total += us;
+        }
+        std::sort(times.begin(), times.end());
+        const double mean = total / times.size();
+        double var{ 0.0 };
+        for (double t : times) {
+            var += (t - mean) * (t - mean);
+        }
+        Result r{ name, params, static_cast<int>(times.size()), times.front(),
+            times[times.size() / 2], mean, std::sqrt(var / times.size()), flops, bytes };
+        _results.push_back(r);
+
+        std::cout << std::left << std::setw(28) << name << std::setw(44)
+            << params_str(params) << std::right << std::fixed << std::setprecision(1)
+            << std::setw(12) << r.median_us << "us";
+        if (flops > 0) {
+            std::cout << std::setw(10) << std::setprecision(2)
+                << flops / r.median_us * 1e-3 << " GFLOP/s";
+        }
+        if (bytes > 0) {
+            std::cout << std::setw(10) << std::setprecision(2)
+                << bytes / r.median_us * 1e-3 << " GB/s";
+        }
+        std::cout << std::defaultfloat << std::endl;
+    }
+
+    const std::vector<Result>& results() const { return _results; }
+
+    void write_json(const std::string& path) const {
+        std::ofstream fout(path);
+        if (!fout) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        fout << "{\"benchmarks\":[\n";
+        for (size_t i{ 0 }; i < _results.size(); i++) {
+            const Result& r = _results[i];
+            fout << "{\"name\":\"" << r.name << "\",\"params\":{";
+            for (size_t k{ 0 }; k < r.params.size(); k++) {
+                fout << (k ? "," : "") << "\"" << r.params[k].first << "\":"
+                    << r.params[k].second;
+            }
+            fout << "},\"reps\":" << r.reps << ",\"min_us\":" << r.min_us
+                << ",\"median_us\":" << r.median_us << ",\"mean_us\":" << r.mean_us
+                << ",\"stddev_us\":" << r.stddev_us << ",\"flops\":" << r.flops
+                << ",\"bytes\":" << r.bytes << "}";
+            fout << (i + 1 < _results.size() ? ",\n" : "\n");
+        }
+        fout << "]}\n";
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,436 @@
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "typedefs.h"
+#include "costs.h"
+#include "convolutions.h"
+#include "max_poling.h"
+#include "layer_activations.h"
+#include "layers.h"
+#include "optimizers.h"
+#include "sequential.h"
+#include "static_sequential.h"
+#include "eigenFuns.h"
+#include "batchCSVReader.h"
+#include "batchPNGReader.h"
+#include "harness.h"
+#include "training.h"
+#include "serving.h"
+
+#define xstr(x) str(x)
+#define str(x) #x
+
+#ifndef DATA_DIR
+#define DATA_DIR ../../
+#endif
+
+using bench::Params;
+using bench::Suite;
+
+namespace fs = std::filesystem;
+
+// -- Kernels on their own, one device per thread count
+
+void benchConvolutions(Suite& suite, const std::vector<int>& threads) {
+    // image size, image depth, kernel size, kernel depth
+    const std::vector<std::array<Index, 4>> shapes{
+        {28, 1, 3, 5}, {28, 1, 5, 8}, {8, 5, 3, 5}, {14, 8, 3, 16}};
+    for (int t : threads) {
+        ThreadPool pool(t);
+        ThreadPoolDevice device(&pool, t);
+        for (Index batch : {32, 128}) {
+            for (const auto& shape : shapes) {
+                const Index im{ shape[0] }, depth{ shape[1] };
+                const Index ker{ shape[2] }, ker_depth{ shape[3] };
+                const Index out = im - ker + 1;
+                const Params params{ {"threads", t}, {"batch", batch}, {"image", im},
+                    {"depth", depth}, {"kernel", ker}, {"kernel_depth", ker_depth} };
+                const double flops = 2.0 * out * out * ker * ker * depth * ker_depth * batch;
+
+                Tensor<float, 5> input(1, im, im, depth, batch);
+                Tensor<float, 4> kernels(ker_depth, 1, ker, ker);
+                Tensor<float, 5> output(1, out, out, depth * ker_depth, batch);
+                input.setRandom();
+                kernels.setRandom();
+                suite.run("convolveBatch", params, flops,
+                    sizeof(float) * (input.size() + output.size()), [&]() {
+                        output.device(device) = convolveBatch(input, kernels);
+                    });
+
+                // backward functions work on one input channel at a time
+                Tensor<float, 4> channel(1, im, im, batch);
+                Tensor<float, 5> grad(1, out, out, ker_depth, batch);
+                Tensor<float, 4> nabla(ker_depth, 1, ker, ker);
+                channel.setRandom();
+                grad.setRandom();
+                Index rows{ im }, cols{ im };
+                const double channel_flops = flops / depth;
+                suite.run("backwardsConvolveInput", params, channel_flops,
+                    sizeof(float) * (channel.size() + grad.size()), [&]() {
+                        channel.device(device) = backwardsConvolveInput(grad, kernels, rows, cols);
+                    });
+                suite.run("backwardsConvolveKernel", params, channel_flops,
+                    sizeof(float) * (channel.size() + grad.size()), [&]() {
+                        nabla.device(device) = backwardsConvolveKernel(channel, grad, ker, ker);
+                    });
+            }
+        }
+    }
+}
+
+void benchPooling(Suite& suite) {
+    // image size, depth, window, stride
+    const std::vector<std::array<Index, 4>> shapes{
+        {26, 5, 3, 3}, {24, 8, 2, 2}, {6, 25, 3, 1}};
+    for (Index batch : {32, 128}) {
+        for (const auto& shape : shapes) {
+            const Index im{ shape[0] }, depth{ shape[1] };
+            const Index window{ shape[2] }, stride{ shape[3] };
+            const Index out = (im - window) / stride + 1;
+            Tensor<float, 5> input(1, im, im, depth, batch);
+            Tensor<float, 5> output(1, out, out, depth, batch);
+            Tensor<Index, 5> argmax(1, out, out, depth, batch);
+            input.setRandom();
+            suite.run("max_pooling", { {"batch", batch}, {"image", im}, {"depth", depth},
+                {"window", window}, {"stride", stride} },
+                static_cast<double>(output.size()) * window * window,
+                sizeof(float) * (input.size() + output.size()) + sizeof(Index) * argmax.size(),
+                [&]() {
+                    max_pooling(input, im, im, depth, batch, window, window, stride,
+                        output, argmax);
+                });
+        }
+    }
+}
+
+void benchSoftmax(Suite& suite, const std::vector<int>& threads) {
+    for (int t : threads) {
+        ThreadPool pool(t);
+        ThreadPoolDevice device(&pool, t);
+        for (Index batch : {32, 256}) {
+            for (Index size : {10, 1000}) {
+                Tensor<float, 2> input(size, batch);
+                Tensor<float, 2> output(size, batch);
+                input.setRandom();
+                suite.run("softmax_fun", { {"threads", t}, {"batch", batch}, {"size", size} },
+                    4.0 * input.size(), 2.0 * sizeof(float) * input.size(), [&]() {
+                        softmax_fun(input, output, &device);
+                    });
+            }
+        }
+    }
+}
+
+// -- Layers and optimizers inside a model, so they run as in training
+
+void benchFC(Suite& suite, const std::vector<int>& threads) {
+    const std::vector<std::array<Index, 2>> shapes{ {784, 100}, {100, 10}, {1024, 1024} };
+    for (const auto& shape : shapes) {
+        const Index in{ shape[0] }, out{ shape[1] };
+        Sequential2 model({ new SigmoidLayer(out) },
+            std::array<Index, 1>{in}, std::array<Index, 1>{out}, new MSE());
+        for (int t : threads) {
+            model.threads(t);
+            for (Index batch : {1, 32, 128}) {
+                Tensor<float, 2> x(in, batch);
+                Tensor<float, 2> y(out, batch);
+                x.setRandom();
+                y.setRandom();
+                model.init(batch);
+                const Params params{ {"threads", t}, {"batch", batch}, {"in", in}, {"out", out} };
+                // the first layer after the input, it computes no input gradient
+                const LayerWork work = model.layers()[1]->work();
+                suite.run("FCLayer::fwd", params, work.fwd_flops, work.fwd_bytes,
+                    [&]() { model.fwdProp(x); });
+                suite.run("FCLayer::bwd", params, work.bwd_flops, work.bwd_bytes,
+                    [&]() { model.bkwProp(y); });
+            }
+        }
+    }
+}
+
+// Fully connected backward products: shuffling the transposed operand
+// (the former FCLayer::bwd) against reading it transposed in the contraction
+void benchFCProducts(Suite& suite, const std::vector<int>& threads) {
+    const Eigen::array<Eigen::IndexPair<int>, 1> product_dims = { Eigen::IndexPair<int>(1, 0) };
+    const Eigen::array<Eigen::IndexPair<int>, 1> product_dims_bt = { Eigen::IndexPair<int>(1, 1) };
+    const Eigen::array<Eigen::IndexPair<int>, 1> product_dims_at = { Eigen::IndexPair<int>(0, 0) };
+    const std::vector<std::array<Index, 2>> shapes{ {784, 100}, {1024, 1024} };
+    for (int t : threads) {
+        ThreadPool pool(t);
+        ThreadPoolDevice device(&pool, t);
+        for (const auto& shape : shapes) {
+            const Index in{ shape[0] }, out{ shape[1] };
+            const Index batch{ 128 };
+            Tensor<float, 2> weights(out, in);
+            Tensor<float, 2> act(in, batch);
+            Tensor<float, 2> delta(out, batch);
+            Tensor<float, 2> nabla_w(out, in);
+            Tensor<float, 2> grad(in, batch);
+            weights.setRandom();
+            act.setRandom();
+            delta.setRandom();
+            const Params params{ {"threads", t}, {"batch", batch}, {"in", in}, {"out", out} };
+            const double flops = 4.0 * out * in * batch;
+            const double bytes = sizeof(float) * (2.0 * out * in + 2.0 * in * batch + out * batch);
+            suite.run("FC products/shuffled", params, flops, bytes, [&]() {
+                nabla_w.device(device) = delta.contract(transposed(act), product_dims);
+                grad.device(device) = transposed(weights).contract(delta, product_dims);
+            });
+            suite.run("FC products/transposed", params, flops, bytes, [&]() {
+                nabla_w.device(device) = delta.contract(act, product_dims_bt);
+                grad.device(device) = weights.contract(delta, product_dims_at);
+            });
+        }
+    }
+}
+
+// Single-sample inference of a small network, Sequential2 against the 
+// same weights in a StaticSequential (which runs on the calling thread)
+void benchStaticSequential(Suite& suite, const std::vector<int>& threads) {
+    Sequential2 model({
+        new SigmoidLayer(32), 
+        new SigmoidLayer(10)
+        },
+        std::array<Index, 1>{64},
+        std::array<Index, 1>{10}
+    );
+    auto fixed = std::make_unique<StaticSequential<64, 1, 
+        StaticDense<64, 32>, StaticSigmoid, StaticDense<32, 10>, StaticSigmoid>>();
+    fixed->load(model.layers());
+    Tensor<float, 2> x(64, 1);
+    x.setRandom();
+    const double flops = 2.0 * (64 * 32 + 32 * 10);
+    const double bytes = sizeof(float) * (64 * 32 + 32 + 32 * 10 + 10 + 64);
+    for (int t : threads) {
+        model.threads(t);
+        model.init(1);
+        suite.run("Sequential2::fwdProp", { {"threads", t}, {"batch", 1}, {"in", 64},
+            {"hidden", 32} }, flops, bytes, [&]() { model.fwdProp(x); });
+    }
+    suite.run("StaticSequential::forward", { {"batch", 1}, {"in", 64}, {"hidden", 32} },
+        flops, bytes, [&]() { fixed->forward(x.data()); });
+}
+
+void benchOptimizers(Suite& suite, const std::vector<int>& threads) {
+    Sequential2 model({ new SigmoidLayer(1024), new SigmoidLayer(10) },
+        std::array<Index, 1>{784}, std::array<Index, 1>{10}, new MSE());
+    std::vector<std::pair<std::string, std::unique_ptr<optim::Optimizer>>> optimizers;
+    optimizers.emplace_back("SGD", std::make_unique<optim::SGD>(0.1f));
+    optimizers.emplace_back("Momentum", std::make_unique<optim::Momentum>(0.1f, 0.9f));
+    optimizers.emplace_back("Adam", std::make_unique<optim::Adam>(0.01f));
+    for (int t : threads) {
+        model.threads(t);
+        for (auto& named : optimizers) {
+            optim::Optimizer* optimizer = named.second.get();
+            optimizer->init(model.parameters());
+            Index size{ 0 };
+            for (const Parameter& p : model.parameters()) {
+                size += p.value._size;
+            }
+            suite.run("Optimizer::step/" + named.first, { {"threads", t}, {"params", size} },
+                optimizer->step_flops(), optimizer->step_bytes(),
+                [&]() { optimizer->step(1.0f, model.device()); });
+        }
+    }
+}
+
+// -- Readers, the files are skipped when they are not there
+
+void benchCSV(Suite& suite, const std::string& data_dir) {
+    const std::string x_path = data_dir + "mnist_csv/val_x.csv";
+    const std::string y_path = data_dir + "mnist_csv/val_y.csv";
+    if (!fs::exists(x_path) || !fs::exists(y_path)) {
+        std::cout << "Skipping BatchCSVIterator::data, " << x_path << " not found\n";
+        return;
+    }
+    for (Index batch : {32, 128, 512}) {
+        BatchCSVReader reader(x_path, y_path, batch);
+        if (reader.size() < batch) {
+            continue;
+        }
+        auto it = reader.begin();
+        suite.run("BatchCSVIterator::data", { {"batch", batch} }, 0.0, 0.0,
+            [&]() { it.data(); });
+    }
+}
+
+void benchPNG(Suite& suite, const std::string& data_dir) {
+    std::string dir = data_dir + "mnist_png/testing";
+    if (!fs::exists(dir)) {
+        std::cout << "Skipping imread_bulk, " << dir << " not found\n";
+        return;
+    }
+    for (Index batch : {32, 128}) {
+        BatchPNGReader reader(dir, batch);
+        if (reader.size() < batch) {
+            continue;
+        }
+        Tensor<byte, 3> images;
+        suite.run("imread_bulk", { {"batch", batch} }, 0.0, 0.0,
+            [&]() { imread_bulk(reader._data, reader._data + batch, images); });
+    }
+}
+
+// -- End-to-end training steps of the example models
+
+void benchTrainingModels(const std::string& which, const bench::TrainingConfig& config,
+    const std::string& out) {
+    std::vector<bench::TrainingResult> results;
+    if (which == "mlp" || which == "all") {
+        Sequential2 model({ new SigmoidLayer(100), new SigmoidLayer(10) },
+            std::array<Index, 1>{784}, std::array<Index, 1>{10}, new CrossEntropy(true));
+        bench::benchTraining("mlp", model, std::array<Index, 1>{784}, 10, config, results);
+    }
+    // BatchCSVReader samples, the CNN of tests/main.cpp
+    if (which == "cnn" || which == "all") {
+        Sequential2 model({
+            new ReshapeLayer<1, 4>(std::array<Index, 4>{1, 28, 28, 1}),
+            new ConvolLayer(std::array<Index, 3>{5, 3, 3}),
+            new PoolingLayer(std::array<Index, 2>{3, 3}, 3),
+            new ConvolLayer(std::array<Index, 3>{5, 3, 3}),
+            new PoolingLayer(std::array<Index, 2>{3, 3}, 1),
+            new FlattenLayer(),
+            new SigmoidLayer(10) },
+            std::array<Index, 1>{784}, std::array<Index, 1>{10}, new CrossEntropy(true));
+        bench::benchTraining("cnn", model, std::array<Index, 1>{784}, 10, config, results);
+    }
+    // BatchPNGReader samples are 28x28 images
+    if (which == "png" || which == "all") {
+        Sequential2 model({
+            new ReshapeLayer<2, 4>(std::array<Index, 4>{1, 28, 28, 1}),
+            new ConvolLayer(std::array<Index, 3>{5, 3, 3}),
+            new PoolingLayer(std::array<Index, 2>{3, 3}, 3),
+            new FlattenLayer(),
+            new SigmoidLayer(10) },
+            std::array<Index, 2>{28, 28}, std::array<Index, 1>{10}, new CrossEntropy(true));
+        bench::benchTraining("png", model, std::array<Index, 2>{28, 28}, 10, config, results);
+    }
+    if (results.empty()) {
+        std::cout << "Unknown model " << which << ", expected mlp, cnn, png or all\n";
+        return;
+    }
+    bench::write_training_json(results, out);
+    std::cout << results.size() << " results written to " << out << "\n";
+}
+
+// -- Concurrent single-sample predictions of the example models
+
+void benchServingModels(const std::string& which, const bench::ServingConfig& config) {
+    if (which == "mlp" || which == "all") {
+        Sequential2 model({ new SigmoidLayer(100), new SigmoidLayer(10) },
+            std::array<Index, 1>{784}, std::array<Index, 1>{10}, new CrossEntropy(true));
+        bench::benchServing("mlp", model, config);
+    }
+    if (which == "cnn" || which == "all") {
+        Sequential2 model({
+            new ReshapeLayer<1, 4>(std::array<Index, 4>{1, 28, 28, 1}),
+            new ConvolLayer(std::array<Index, 3>{5, 3, 3}),
+            new PoolingLayer(std::array<Index, 2>{3, 3}, 3),
+            new FlattenLayer(),
+            new SigmoidLayer(10) },
+            std::array<Index, 1>{784}, std::array<Index, 1>{10}, new CrossEntropy(true));
+        bench::benchServing("cnn", model, config);
+    }
+}
+
+// Usage: nnn_bench [--filter name] [--out results.json] [--min-ms ms]
+//                  [--threads 1,2,4]
+//        nnn_bench --train mlp|cnn|png|all [--batch 128] [--warmup 5]
+//                  [--steps 50] [--max-threads 4] [--out results.json]
+//        nnn_bench --serve mlp|cnn|all [--clients 16] [--requests 200]
+//                  [--max-batch 32] [--max-delay-us 1000]
+int main(int argc, char** argv) {
+    std::string filter;
+    std::string out{ "nnn_bench.json" };
+    double min_ms{ 200.0 };
+    std::vector<int> threads{ 1, 2, 4, 8 };
+    std::string train;
+    bench::TrainingConfig config;
+    std::string serve;
+    bench::ServingConfig serving;
+    config.max_threads = static_cast<int>(std::thread::hardware_concurrency());
+    for (int i{ 1 }; i + 1 < argc; i += 2) {
+        const std::string arg{ argv[i] };
+        if (arg == "--filter") {
+            filter = argv[i + 1];
+        }
+        else if (arg == "--out") {
+            out = argv[i + 1];
+        }
+        else if (arg == "--min-ms") {
+            min_ms = std::stod(argv[i + 1]);
+        }
+        else if (arg == "--threads") {
+            threads.clear();
+            std::stringstream s{ std::string(argv[i + 1]) };
+            std::string n;
+            while (std::getline(s, n, ',')) {
+                threads.push_back(std::stoi(n));
+            }
+        }
+        else if (arg == "--train") {
+            train = argv[i + 1];
+        }
+        else if (arg == "--batch") {
+            config.batch = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--warmup") {
+            config.warmup = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--steps") {
+            config.steps = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--serve") {
+            serve = argv[i + 1];
+        }
+        else if (arg == "--clients") {
+            serving.clients = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--requests") {
+            serving.requests = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--max-batch") {
+            serving.max_batch = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--max-delay-us") {
+            serving.max_delay_us = std::stoi(argv[i + 1]);
+        }
+        else if (arg == "--max-threads") {
+            config.max_threads = std::stoi(argv[i + 1]);
+        }
+        else {
+            std::cout << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    if (!serve.empty()) {
+        benchServingModels(serve, serving);
+        return 0;
+    }
+    if (!train.empty()) {
+        benchTrainingModels(train, config, out);
+        return 0;
+    }
+
+    Suite suite(filter, min_ms);
+    const std::string data_dir = xstr(DATA_DIR);
+    benchConvolutions(suite, threads);
+    benchPooling(suite);
+    benchSoftmax(suite, threads);
+    benchFC(suite, threads);
+    benchFCProducts(suite, threads);
+    benchStaticSequential(suite, threads);
+    benchOptimizers(suite, threads);
+    benchCSV(suite, data_dir);
+    benchPNG(suite, data_dir);
+
+    suite.write_json(out);
+    std::cout << suite.results().size() << " results written to " << out << "\n";
+}
@@ -0,0 +1,110 @@
+#ifndef BENCH_SERVING_H
+#define BENCH_SERVING_H
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sequential.h"
+#include "inference.h"
+
+namespace bench
+{
+
+struct ServingConfig
+{
+    int clients{ 16 };
+    int requests{ 200 };
+    Index max_batch{ 16 };
+    int max_delay_us{ 1000 };
+};
+
+// -- Concurrent single-sample predictions: every client sends a request
+// and waits for its result before the next one. Served one at a time
+// under a lock (batch 1), by an ExecutionContext per client sharing the
+// weights and through an InferenceEngine
+template<size_t in_dims, size_t out_dims>
+void benchServing(const std::string& name, Sequential2<in_dims, out_dims>& model,
+    const ServingConfig& config) {
+    typedef std::chrono::steady_clock clock;
+    Tensor<float, in_dims> sample(model.in_shape());
+    sample.setRandom();
+
+    auto run = [&](const std::string& mode, auto&& predict) {
+        std::vector<std::vector<double>> latencies(config.clients);
+        const clock::time_point start = clock::now();
+        std::vector<std::thread> clients;
+        for (int c{ 0 }; c < config.clients; c++) {
+            clients.emplace_back([&, c]() {
+                for (int r{ 0 }; r < config.requests; r++) {
+                    const clock::time_point sent = clock::now();
+                    predict(c, sample);
+                    latencies[c].push_back(std::chrono::duration<double, std::milli>(
+                        clock::now() - sent).count());
+                }
+            });
+        }
+        for (std::thread& client : clients) {
+            client.join();
+        }
+        const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        std::vector<double> all;
+        for (const std::vector<double>& l : latencies) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        std::sort(all.begin(), all.end());
+        std::cout << std::left << std::setw(8) << name << std::setw(10) << mode
+            << std::right << std::fixed << std::setprecision(1) << std::setw(12)
+            << all.size() / seconds << " requests/s  p50 " << std::setprecision(3)
+            << all[all.size() / 2] << "ms p99 " << all[all.size() * 99 / 100] << "ms"
+            << std::defaultfloat << std::endl;
+    };
+
+    {
+        std::mutex lock;
+        model.init(1);
+        Tensor<float, in_dims + 1> x;
+        std::array<Index, in_dims + 1> shape;
+        std::copy(model.in_shape().begin(), model.in_shape().end(), shape.begin());
+        shape.back() = 1;
+        x = Tensor<float, in_dims + 1>(shape);
+        run("batch 1", [&](int, const Tensor<float, in_dims>& s) {
+            std::lock_guard<std::mutex> guard(lock);
+            std::copy_n(s.data(), s.size(), x.data());
+            model.fwdProp(x);
+            return model.output(1);
+        });
+    }
+    {
+        std::vector<ExecutionContext<in_dims, out_dims>> contexts;
+        for (int c{ 0 }; c < config.clients; c++) {
+            contexts.push_back(model.context());
+        }
+        std::array<Index, in_dims + 1> shape;
+        std::copy(model.in_shape().begin(), model.in_shape().end(), shape.begin());
+        shape.back() = 1;
+        run("contexts", [&](int c, const Tensor<float, in_dims>& s) {
+            Tensor<float, in_dims + 1> x = s.reshape(shape);
+            contexts[c].fwdProp(x);
+            return Tensor<float, out_dims + 1>(contexts[c].output());
+        });
+    }
+    {
+        InferenceEngine engine(model, config.max_batch,
+            std::chrono::microseconds(config.max_delay_us));
+        run("engine", [&](int, const Tensor<float, in_dims>& s) {
+            return engine.submit(s).get();
+        });
+        const auto stats = engine.stats();
+        std::cout << std::setw(18) << "" << "average batch "
+            << static_cast<double>(stats.requests) / stats.batches << "\n";
+    }
+}
+
+}
+
+#endif
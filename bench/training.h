@@ -0,0 +1,149 @@
+#ifndef BENCH_TRAINING_H
+#define BENCH_TRAINING_H
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sequential.h"
+#include "optimizers.h"
+#include "harness.h"
+
+namespace bench
+{
+
+struct TrainingConfig
+{
+    Index batch{ 128 };
+    int warmup{ 5 };
+    int steps{ 50 };
+    int max_threads{ 4 };
+};
+
+struct TrainingResult
+{
+    std::string model;
+    Index batch;
+    int threads;
+    int steps;
+    double samples_per_sec;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    // throughput over threads times the single-thread throughput
+    double efficiency;
+    // high-water mark of the measured steps only, see RssPeak
+    size_t peak_rss;
+};
+
+// 1, 2, 4, ... up to n, n included
+inline std::vector<int> thread_counts(int n) {
+    std::vector<int> counts;
+    for (int t{ 1 }; t < n; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(std::max(n, 1));
+    return counts;
+}
+
+// -- Training steps (forward, backward, optimizer step) on random data
+// with the shape a reader would produce, so no I/O, shuffling or
+// evaluation is timed. The first warmup steps are not measured.
+template<size_t in_dims, size_t out_dims>
+void benchTraining(const std::string& name, Sequential2<in_dims, out_dims>& model,
+    std::array<Index, in_dims> in_shape, Index classes, const TrainingConfig& config,
+    std::vector<TrainingResult>& results) {
+    typedef std::chrono::steady_clock clock;
+
+    std::array<Index, in_dims + 1> x_shape;
+    std::copy(in_shape.begin(), in_shape.end(), x_shape.begin());
+    x_shape.back() = config.batch;
+    Tensor<float, in_dims + 1> x(x_shape);
+    x.setRandom();
+    // one-hot labels
+    Tensor<float, 2> y(classes, config.batch);
+    y.setZero();
+    for (Index j{ 0 }; j < config.batch; j++) {
+        y(j % classes, j) = 1.0f;
+    }
+
+    const float scale = 1.0f / config.batch;
+    double single{ 0.0 };
+    for (int t : thread_counts(config.max_threads)) {
+        model.threads(t);
+        model.init(config.batch);
+        optim::Adam optimizer(1e-3f);
+        optimizer.init(model.parameters());
+
+        std::vector<double> times;
+        RssPeak rss;
+        for (int s{ 0 }; s < config.warmup + config.steps; s++) {
+            if (s == config.warmup) {
+                rss.reset();
+            }
+            const clock::time_point start = clock::now();
+            model.fwdProp(x);
+            model.bkwProp(y);
+            optimizer.step(scale, model.device());
+            if (s >= config.warmup) {
+                times.push_back(std::chrono::duration<double, std::milli>(
+                    clock::now() - start).count());
+                rss.sample();
+            }
+        }
+
+        double total{ 0.0 };
+        for (double ms : times) {
+            total += ms;
+        }
+        std::sort(times.begin(), times.end());
+        auto percentile = [&](double p) {
+            return times[std::min(times.size() - 1,
+                static_cast<size_t>(p * times.size()))];
+        };
+        const double throughput = 1000.0 * config.batch * times.size() / total;
+        if (t == 1) {
+            single = throughput;
+        }
+        TrainingResult r{ name, config.batch, t, config.steps, throughput,
+            percentile(0.5), percentile(0.9), percentile(0.99),
+            single > 0 ? throughput / (t * single) : 0.0, rss.peak() };
+        results.push_back(r);
+
+        std::cout << std::left << std::setw(8) << name << std::right
+            << " threads " << std::setw(3) << t << std::fixed << std::setprecision(1)
+            << std::setw(12) << r.samples_per_sec << " samples/s"
+            << "  p50 " << std::setprecision(2) << r.p50_ms << "ms p90 " << r.p90_ms
+            << "ms p99 " << r.p99_ms << "ms  efficiency " << r.efficiency
+            << "  peak RSS " << r.peak_rss / (1 << 20) << "MB"
+            << std::defaultfloat << std::endl;
+    }
+}
+
+inline void write_training_json(const std::vector<TrainingResult>& results,
+    const std::string& path) {
+    std::ofstream fout(path);
+    if (!fout) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    fout << "{\"training\":[\n";
+    for (size_t i{ 0 }; i < results.size(); i++) {
+        const TrainingResult& r = results[i];
+        fout << "{\"model\":\"" << r.model << "\",\"batch\":" << r.batch
+            << ",\"threads\":" << r.threads << ",\"steps\":" << r.steps
+            << ",\"samples_per_sec\":" << r.samples_per_sec
+            << ",\"p50_ms\":" << r.p50_ms << ",\"p90_ms\":" << r.p90_ms
+            << ",\"p99_ms\":" << r.p99_ms << ",\"efficiency\":" << r.efficiency
+            << ",\"peak_rss\":" << r.peak_rss << "}";
+        fout << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    fout << "]}\n";
+}
+
+}
+
+#endif
@@ -1,7 +1,11 @@
 #ifndef TENSORWRAP_H
 #define TENSORWRAP_H
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
 #include "typedefs.h"
 
 template<typename T, int NumDimensions>
@@ -28,6 +32,11 @@ public:
     template<int NumDimensions>
     TensorWrapper(Tensor<T, NumDimensions>&& t)
         :data{t.data()}, _size{static_cast<size_t>(t.size())}{}
+    template<int NumDimensions>
+    TensorWrapper(TensorMap<Tensor<T, NumDimensions>>& t)
+        :data{t.data()}, _size{static_cast<size_t>(t.size())}{}
+    TensorWrapper(T* ptr, size_t size)
+        :data{ptr}, _size{size}{}
     
     // Return as Eigen 
     template<size_t NumDimensions>
@@ -46,6 +55,53 @@ public:
     }
 };
 
+// Points an existing TensorMap to other memory, assigning a TensorMap 
+// would copy the values instead
+template<typename Map, typename Shape>
+void rebind(Map& map, typename Map::Scalar* data, const Shape& shape){
+    new (&map) Map(data, shape);
+}
+
+// Tensors packed in a flat buffer start at multiples of 64 bytes from
+// its start, see AlignedBuffer
+inline Index aligned_size(Index size){
+    constexpr Index align = 64 / sizeof(float);
+    return (size + align - 1) / align * align;
+}
+
+// Zero-filled flat buffer starting on a 64-byte boundary, so tensors
+// packed with aligned_size do too. Eigen's own tensors are only aligned
+// to EIGEN_MAX_ALIGN_BYTES (16 or 32)
+class AlignedBuffer
+{
+    static constexpr std::align_val_t align{ 64 };
+    struct Free
+    {
+        void operator()(float* p) const { ::operator delete(p, align); }
+    };
+    std::unique_ptr<float, Free> _data;
+    Index _size{ 0 };
+public:
+    AlignedBuffer() = default;
+    explicit AlignedBuffer(Index size)
+        :_data{ static_cast<float*>(::operator new(size * sizeof(float), align)) }, 
+        _size{ size }{
+        std::fill_n(_data.get(), size, 0.0f);
+    }
+    float* data(){ return _data.get(); }
+    const float* data() const { return _data.get(); }
+    Index size() const { return _size; }
+};
+
+// Trainable tensor together with its (batch-summed) gradient
+struct Parameter
+{
+    TensorWrapper<float> value;
+    TensorWrapper<float> grad;
+    // weight decay is only applied to weights, never to biases
+    bool decay = true;
+};
+
 class TensorShape
 {
     size_t _size;
@@ -72,6 +128,10 @@ public:
         return temp;
     }
 
+    std::vector<Index> dims(){
+        return std::vector<Index>(data, data + _size);
+    }
+
     template<typename shape_t>
     bool compatible(){
         return std::tuple_size<shape_t>{} == _size;
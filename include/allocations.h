@@ -0,0 +1,74 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <cstddef>
+
+// -- Allocation counters
+// Built with NNN_TRACK_ALLOCATIONS, every heap allocation made by Eigen
+// (tensors, temporaries of evaluated expressions) and every operator new
+// is counted. The counters are process wide: they are not hooked into the
+// tensors of a layer or reader, so anything else allocating between two
+// reads (other threads included) is counted too. Included by typedefs.h
+// before Eigen, so it must not include Eigen itself.
+namespace mem
+{
+
+struct AllocationCounts
+{
+    size_t eigen{ 0 };
+    size_t heap{ 0 };
+    size_t heap_bytes{ 0 };
+};
+
+#ifdef NNN_TRACK_ALLOCATIONS
+constexpr bool tracking_allocations = true;
+#else
+constexpr bool tracking_allocations = false;
+#endif
+
+// Allocations made so far, all zero unless tracking
+AllocationCounts allocation_counts();
+
+// Called by Eigen's check before each of its allocations, see below
+void count_eigen_allocation();
+
+namespace internal
+{
+// True for the text of the assertion Eigen checks in aligned_malloc
+constexpr bool is_malloc_check(const char* expr) {
+    const char* name = "is_malloc_allowed()";
+    for (; *expr != '\0'; expr++) {
+        size_t i{ 0 };
+        while (name[i] != '\0' && expr[i] == name[i]) {
+            i++;
+        }
+        if (name[i] == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+}
+
+}
+
+#ifdef NNN_TRACK_ALLOCATIONS
+// With EIGEN_RUNTIME_NO_MALLOC Eigen asserts that allocations are allowed
+// before each one. They never are (src/allocations.cpp), so that assertion
+// counts an allocation instead of failing. Which assertion it is, is decided
+// at compile time: every other one expands to Eigen's own, so a release
+// build runs the same code as without tracking, plus one flag read and one
+// atomic increment per Eigen allocation, and operator new is replaced.
+#define EIGEN_RUNTIME_NO_MALLOC
+#define eigen_assert(x) \
+    do { \
+        if constexpr (::mem::internal::is_malloc_check(#x)) { \
+            if (!(x)) ::mem::count_eigen_allocation(); \
+        } \
+        else { \
+            eigen_plain_assert(x); \
+        } \
+    } while (false)
+#endif
+
+#endif
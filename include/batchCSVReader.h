@@ -7,6 +7,7 @@
 #include <exception>
 #include "typedefs.h"
 #include "batchReader.h"
+#include "sparse.h"
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
@@ -32,6 +33,7 @@ struct BatchCSVIterator
 	{
 		_labels = Tensor<float, 2>(_num_labels, _batch);
 		_data = Tensor<float, 2>(_num_data, _batch);
+		_sparse = SparseBatch(_num_data);
 	}
 
 	BatchCSVIterator& operator ++() {
@@ -77,6 +79,22 @@ struct BatchCSVIterator
 		return _data;
 	}
 
+	// Same batch keeping only the non-zero values
+	SparseBatch& sparse_data() {
+		_sparse.clear();
+		for (Index i{ 0 }; i < _batch; i++) {
+			it_t* it = _begin + i;
+			read_line_sparse(_data_file, it->first.first, it->first.second);
+			_sparse.close_sample();
+		}
+		return _sparse;
+	}
+
+	// Memory held by the batch buffers
+	size_t bytes() const {
+		return (_data.size() + _labels.size()) * sizeof(float) + _sparse.bytes();
+	}
+
 private:
 	void read_line(float* data, char* ifs, Index off, Index size) {
 		std::string s(size, '0');
@@ -88,6 +106,20 @@ private:
 			i++;
 		}
 	}
+
+	void read_line_sparse(char* ifs, Index off, Index size) {
+		std::string s(size, '0');
+		std::copy_n(ifs + off, size, s.data());
+		Tokenizer tok(s, _seps);
+		int i = 0;
+		for (auto it : tok) {
+			const float value = std::stof(it);
+			if (value != 0.0f) {
+				_sparse.push(i, value);
+			}
+			i++;
+		}
+	}
 	
 
 
@@ -97,6 +129,7 @@ private:
 	char* _label_file;
 	Tensor<float, 2> _data;
 	Tensor<float, 2> _labels;
+	SparseBatch _sparse;
 	Index _num_labels;
 	Index _num_data;
 	boost::escaped_list_separator<char> _seps;
@@ -95,6 +95,11 @@ struct BatchPNGIterator
 		return _images.cast<float>() / 255.0f;
 	}
 
+	// Memory held by the batch buffers
+	size_t bytes() const {
+		return _images.size() * sizeof(byte) + _labels.size() * sizeof(float);
+	}
+
 private:
 	it_t* _begin;
 	Index _batch;
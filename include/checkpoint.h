@@ -0,0 +1,77 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "typedefs.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// -- Binary checkpoints
+// Layout (native endianness):
+//  - Header
+//  - one record per layer: descriptor length (uint32), descriptor,
+//    rank (uint32), out shape (int64 x rank), number of parameters (int64)
+//  - flat parameter buffer, 64-byte aligned, same layout as Sequential2's
+//  - optimizer state, 64-byte aligned
+// Since the parameter block is aligned and stored exactly as the model 
+// keeps it in memory, a mapped file can be used by the layers in place.
+namespace ckpt
+{
+
+inline constexpr char magic[4] = {'N', 'N', 'N', 'C'};
+inline constexpr uint32_t version = 1;
+
+struct Header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t num_layers;
+    uint64_t num_params;
+    uint64_t params_offset;
+    uint64_t state_size;
+    uint64_t state_offset;
+    uint64_t steps;
+};
+
+struct LayerRecord
+{
+    std::string descriptor;
+    std::vector<Index> out_shape;
+    Index num_params;
+
+    bool operator==(const LayerRecord& other) const {
+        return descriptor == other.descriptor && out_shape == other.out_shape
+            && num_params == other.num_params;
+    }
+    bool operator!=(const LayerRecord& other) const { return !(*this == other); }
+};
+
+void write(const std::string& path, const std::vector<LayerRecord>& layers,
+    const float* params, Index num_params, 
+    const float* state, Index state_size, Index steps);
+
+// Checkpoint file mapped copy-on-write: pages are shared with the page 
+// cache until they are written to
+class MappedCheckpoint
+{
+    boost::interprocess::file_mapping _file;
+    boost::interprocess::mapped_region _region;
+    Header _header;
+    std::vector<LayerRecord> _layers;
+public:
+    MappedCheckpoint(const std::string& path);
+
+    const std::vector<LayerRecord>& layers() const { return _layers; }
+    float* params();
+    Index num_params() const { return static_cast<Index>(_header.num_params); }
+    const float* state();
+    Index state_size() const { return static_cast<Index>(_header.state_size); }
+    Index steps() const { return static_cast<Index>(_header.steps); }
+};
+
+}
+
+#endif
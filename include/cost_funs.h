@@ -1,12 +1,33 @@
 #ifndef COST_FUNS_H
 #define COST_FUNS_H
 
+#include <vector>
+#include <cmath>
+#include <numeric>
 #include "typedefs.h"
 #include "layer_activations.h"
 
 namespace Eigen
 {
 
+namespace internal
+{
+// Runs column_loss(j), which writes the gradient of column j and returns
+// its cost, over the columns of a batch in parallel and sums the costs
+template<typename Scalar, typename F>
+Scalar sum_column_losses(Index rows, Index cols, ThreadPoolDevice* device, 
+    const TensorOpCost& cost, F column_loss) {
+    std::vector<Scalar> col_loss(cols);
+    Scalar* loss_ptr = col_loss.data();
+    device->parallelFor(cols, cost, [=](Index first, Index last) {
+        for (Index j{ first }; j < last; j++) {
+            loss_ptr[j] = column_loss(j);
+        }
+    });
+    return std::accumulate(col_loss.begin(), col_loss.end(), Scalar(0));
+}
+}
+
 template<typename ArgType1, typename ArgType2>
 Tensor<typename internal::traits<ArgType1>::Scalar, 0>
 mse_fun(ArgType1& input, ArgType2& output, 
@@ -19,14 +40,27 @@ mse_fun(ArgType1& input, ArgType2& output,
         .sqrt().sum(along_input);
 }
 
+// Writes grad = a - y and returns the cost of the batch, each column's
+// norm is taken while its gradient is in cache
 template<typename ArgType1, typename ArgType2, 
     typename ArgType3>
-void
+typename internal::traits<ArgType1>::Scalar
 mse_grad_fun(ArgType1& input, ArgType2& output, 
     ArgType3& grad, ThreadPoolDevice* device) {
-    grad.setConstant(0.0f);
-    //grad.device(*device) = output - input;
-    grad.device(*device) = input - output;
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    typedef Map<const Array<Scalar, Dynamic, 1>> const_col_t;
+    const Index rows = input.dimension(0);
+    const Scalar* a_ptr = input.data();
+    const Scalar* y_ptr = output.data();
+    Scalar* grad_ptr = grad.data();
+    const double bytes = static_cast<double>(rows * sizeof(Scalar));
+    return internal::sum_column_losses<Scalar>(rows, input.dimension(1), device,
+        TensorOpCost(2 * bytes, bytes, 3 * rows), [=](Index j) {
+            const Index off = j * rows;
+            Map<Array<Scalar, Dynamic, 1>> g(grad_ptr + off, rows);
+            g = const_col_t(a_ptr + off, rows) - const_col_t(y_ptr + off, rows);
+            return std::sqrt(g.square().sum());
+        });
 }
 
 template<typename ArgType1, typename ArgType2> 
@@ -68,6 +102,74 @@ cross_entropy_grad_fun(ArgType1& input, ArgType2& output, ArgType3& grad,
     }
 }
 
+
+// -- Fused binary cross-entropy backward. Writes 
+// grad = (1 - y) / (1 - a) - y / a and returns 
+// -sum(y log(a) + (1 - y) log(1 - a)) in the same pass per column.
+template<typename ArgType1, typename ArgType2, 
+    typename ArgType3>
+typename internal::traits<ArgType1>::Scalar
+cross_entropy_loss_grad_fun(ArgType1& input, ArgType2& output, 
+    ArgType3& grad, ThreadPoolDevice* device) {
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    typedef Map<const Array<Scalar, Dynamic, 1>> const_col_t;
+    const Index rows = input.dimension(0);
+    const Scalar* a_ptr = input.data();
+    const Scalar* y_ptr = output.data();
+    Scalar* grad_ptr = grad.data();
+    const double bytes = static_cast<double>(rows * sizeof(Scalar));
+    return internal::sum_column_losses<Scalar>(rows, input.dimension(1), device,
+        TensorOpCost(2 * bytes, bytes, 12 * rows), [=](Index j) {
+            const Index off = j * rows;
+            const const_col_t a(a_ptr + off, rows);
+            const const_col_t y(y_ptr + off, rows);
+            Map<Array<Scalar, Dynamic, 1>>(grad_ptr + off, rows) = 
+                (Scalar(1) - y) / (Scalar(1) - a) - y / a;
+            return -(y * a.log() + (Scalar(1) - y) * (Scalar(1) - a).log()).sum();
+        });
+}
+
+// Categorical cross-entropy of logits through the log-softmax, the cost
+// the fused backward below reports for the same batch
+template<typename ArgType1, typename ArgType2> 
+Tensor<typename internal::traits<ArgType1>::Scalar, 0>
+softmax_cross_entropy_fun(ArgType1& input, ArgType2& output, 
+    ThreadPoolDevice* device) {
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    Tensor<Scalar, 2> act(input.dimensions());
+    Tensor<Scalar, 2> log_act(input.dimensions());
+    log_softmax_fun(input, act, log_act, device);
+    Tensor<Scalar, 0> cost;
+    cost.device(*device) = -(output * log_act).sum();
+    return cost;
+}
+
+// -- Fused softmax + categorical cross-entropy backward. Takes the 
+// activations and log-probabilities written by log_softmax_fun, writes 
+// grad = a - y and returns -sum(y * log(a)) in the same pass per column.
+template<typename ArgType1, typename ArgType2, 
+    typename ArgType3, typename ArgType4>
+typename internal::traits<ArgType1>::Scalar
+softmax_cross_entropy_grad_fun(ArgType1& input, ArgType2& log_input, 
+    ArgType3& output, ArgType4& grad, ThreadPoolDevice* device) {
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    typedef Map<const Array<Scalar, Dynamic, 1>> const_col_t;
+    const Index rows = input.dimension(0);
+    const Scalar* a_ptr = input.data();
+    const Scalar* log_ptr = log_input.data();
+    const Scalar* y_ptr = output.data();
+    Scalar* grad_ptr = grad.data();
+    const double bytes = static_cast<double>(rows * sizeof(Scalar));
+    return internal::sum_column_losses<Scalar>(rows, input.dimension(1), device,
+        TensorOpCost(3 * bytes, bytes, 4 * rows), [=](Index j) {
+            const Index off = j * rows;
+            const const_col_t y(y_ptr + off, rows);
+            Map<Array<Scalar, Dynamic, 1>>(grad_ptr + off, rows) = 
+                const_col_t(a_ptr + off, rows) - y;
+            return -(y * const_col_t(log_ptr + off, rows)).sum();
+        });
+}
+
 }
 
 #endif
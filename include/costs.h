@@ -13,7 +13,12 @@
 // -- Base clases
 class CostFun
 {
+protected:
+    float _loss = 0.0f;
 public:
+    // Cost of the last batch seen by grad(), summed over its samples
+    float loss() const { return _loss; }
+
     virtual Tensor<float, 0> cost(TensorWrapper<float>& a,
                         TensorWrapper<float>& y, ThreadPoolDevice*) = 0;
     virtual void grad(
@@ -24,6 +29,12 @@ public:
         TensorWrapper<float>& act, ThreadPoolDevice*) = 0;
 
     virtual void init(TensorShape&& shape) = 0;
+    // act() returns z unchanged, the output layer can then use the 
+    // previous layer's buffer as its activation
+    virtual bool identity_act() const { return false; }
+    // Memory kept between act() and grad()
+    virtual size_t bytes() const { return 0; }
+    virtual CostFun* clone() const = 0;
     virtual ~CostFun() = default;
 };
 
@@ -60,6 +71,10 @@ public:
     void init(TensorShape&& shape) {
         _shape = shape_t(shape.get<shape_t>());
     }
+
+    CostFun* clone() const override {
+        return new Derived(static_cast<const Derived&>(*this));
+    }
 };
 
 template<size_t N>
@@ -82,6 +97,8 @@ public:
         ThreadPoolDevice*) {
         act = z;
     }
+
+    bool identity_act() const override { return true; }
 };
 
 // -- Implementations
@@ -98,14 +115,19 @@ public:
 
     void act(tmap_t z, tmap_t act, 
         ThreadPoolDevice*);
+
+    bool identity_act() const override { return true; }
 };
 
 class CrossEntropy : public CostFunTempl<CrossEntropy>
 {
     typedef TensorMap<Tensor<float, 2>> tmap_t;
     bool _softmax;
+    // log-probabilities of the last forward pass, used by grad()
+    Tensor<float, 2> _log_act;
 public:
     CrossEntropy(bool softmax=true) :_softmax{ softmax } {}
+    void init(TensorShape&& shape) override;
     Tensor<float, 0> cost(tmap_t a,
         tmap_t y, ThreadPoolDevice*);
 
@@ -114,6 +136,9 @@ public:
 
     void act(tmap_t z, tmap_t act, 
         ThreadPoolDevice*);
+
+    bool identity_act() const override { return !_softmax; }
+    size_t bytes() const override { return _log_act.size() * sizeof(float); }
 };
 
 #endif
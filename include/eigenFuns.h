@@ -217,4 +217,28 @@ auto sliced(const ArgType&& arg, const std::vector<int>& indices, int dim)
   return out_slice;
 }
 
+// -- Gather samples along the last dimension into a preallocated tensor.
+// Each sample is a contiguous block, so every one is a straight copy and
+// the copies are spread over the thread pool
+template<typename ArgType1, typename ArgType2>
+void gather(const ArgType1& arg, const int* indices, ArgType2& out,
+  ThreadPoolDevice* device)
+{
+  typedef typename ArgType1::Scalar Scalar;
+  const Eigen::Index n = out.dimension(ArgType2::NumDimensions - 1);
+  const Eigen::Index sample_size = out.size() / n;
+  assert(arg.size() / arg.dimension(ArgType1::NumDimensions - 1) == sample_size);
+  const Scalar* src = arg.data();
+  Scalar* dst = out.data();
+  const double bytes = static_cast<double>(sample_size * sizeof(Scalar));
+
+  device->parallelFor(n, Eigen::TensorOpCost(bytes, bytes, 0),
+    [=](Eigen::Index first, Eigen::Index last){
+      for(Eigen::Index i{first}; i < last; i++){
+        std::copy_n(src + indices[i] * sample_size, sample_size, 
+          dst + i * sample_size);
+      }
+    });
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef EXECUTION_CONTEXT_H
+#define EXECUTION_CONTEXT_H
+
+#include <memory>
+#include <vector>
+#include "typedefs.h"
+#include "layers.h"
+
+// -- Execution context
+// Mutable state of forward passes over a model: clones of its layers with
+// their own activations, argmax and cost buffers, whose parameter views
+// read the model's flat buffers. Each thread serving a model owns one
+// context, so N threads share a single copy of the weights.
+// The model has to outlive its contexts and its weights must not change
+// (training, load) while they run.
+template<size_t num_dims_in, size_t num_dims_out>
+class ExecutionContext
+{
+    typedef Tensor<float, num_dims_in + 1> in_batch_t;
+    typedef TensorMap<Tensor<float, num_dims_out + 1>> out_map_t;
+
+    std::vector<std::unique_ptr<BaseLayer>> _layers;
+    // layers after the input that are not views, as in Sequential2
+    std::vector<BaseLayer*> _compute;
+    std::array<Index, num_dims_out> _out_shape;
+    std::unique_ptr<ThreadPool> _pool;
+    std::unique_ptr<ThreadPoolDevice> _device;
+    Index _batch{ 0 };
+public:
+    ExecutionContext(const std::vector<BaseLayer*>& layers,
+        std::array<Index, num_dims_out> out_shape, int threads)
+        :_out_shape{ out_shape }, _pool{ new ThreadPool(threads) },
+        _device{ new ThreadPoolDevice(_pool.get(), threads) }
+    {
+        for (BaseLayer* layer : layers) {
+            _layers.emplace_back(layer->clone());
+            _layers.back()->_training = false;
+        }
+        for (size_t i{ 0 }; i < _layers.size(); i++) {
+            _layers[i]->_prev = i > 0 ? _layers[i - 1].get() : nullptr;
+            _layers[i]->_next = i + 1 < _layers.size() ? _layers[i + 1].get() : nullptr;
+            if (i > 0 && !_layers[i]->is_view()) {
+                _compute.push_back(_layers[i].get());
+            }
+        }
+    }
+
+    // Layers are only initialized again when the batch size changes
+    void fwdProp(in_batch_t& input) {
+        const Index batch = input.dimension(num_dims_in);
+        if (batch != _batch) {
+            for (auto& layer : _layers) {
+                layer->init(batch);
+            }
+            _batch = batch;
+        }
+        _layers.front()->fwd(TensorWrapper(input), _device.get());
+        for (BaseLayer* layer : _compute) {
+            layer->fwd(_device.get());
+        }
+    }
+
+    void fwdProp(in_batch_t&& input) { fwdProp(input); }
+
+    // Output of the last fwdProp, valid until the next one
+    out_map_t output() {
+        std::array<Index, num_dims_out + 1> shape;
+        std::copy(_out_shape.begin(), _out_shape.end(), shape.begin());
+        shape.back() = _batch;
+        return _layers.back()->get_act().get(shape);
+    }
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "typedefs.h"
+#include "sequential.h"
+
+// -- Inference engine
+// Serves single-sample predictions from any number of threads. Requests
+// are queued and a worker coalesces them into micro-batches: a batch is
+// run once it holds max_batch samples or its oldest request has waited
+// max_delay. Batches are padded to the next power of two, the model is
+// only initialized again when that size changes, so under a steady load
+// the layers do not reallocate. Results are handed back through futures.
+// The engine owns the model's forward passes while it runs, the model
+// must not be used elsewhere until the engine is destroyed.
+template<size_t num_dims_in, size_t num_dims_out>
+class InferenceEngine
+{
+public:
+    typedef Tensor<float, num_dims_in> sample_t;
+    typedef Tensor<float, num_dims_out> result_t;
+    typedef std::chrono::steady_clock clock;
+
+    struct Stats
+    {
+        size_t requests;
+        size_t batches;
+    };
+private:
+    typedef Tensor<float, num_dims_in + 1> in_batch_t;
+
+    struct Request
+    {
+        sample_t sample;
+        std::promise<result_t> result;
+        clock::time_point arrival;
+    };
+
+    Sequential2<num_dims_in, num_dims_out>& _model;
+    const Index _max_batch;
+    const clock::duration _max_delay;
+    Index _in_size{ 1 };
+    Index _out_size{ 1 };
+    // size the model and _batch are initialized for
+    Index _padded{ 0 };
+    in_batch_t _batch;
+
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<Request> _queue;
+    bool _stop{ false };
+    std::atomic<size_t> _requests{ 0 };
+    std::atomic<size_t> _batches{ 0 };
+    std::thread _worker;
+
+    void run_batch(std::vector<Request>& requests) {
+        const Index n = static_cast<Index>(requests.size());
+        Index padded{ 1 };
+        while (padded < n) {
+            padded *= 2;
+        }
+        padded = std::min(padded, _max_batch);
+        if (padded != _padded) {
+            std::array<Index, num_dims_in + 1> batch_shape;
+            std::copy(_model.in_shape().begin(), _model.in_shape().end(), batch_shape.begin());
+            batch_shape.back() = padded;
+            _batch = in_batch_t(batch_shape);
+            _batch.setZero();
+            _model.init(padded);
+            _padded = padded;
+        }
+        for (Index j{ 0 }; j < n; j++) {
+            std::copy_n(requests[j].sample.data(), _in_size, _batch.data() + j * _in_size);
+        }
+        _batches++;
+        try {
+            _model.fwdProp(_batch);
+        }
+        catch (...) {
+            for (Request& request : requests) {
+                request.result.set_exception(std::current_exception());
+            }
+            return;
+        }
+        // columns past n are padding
+        const float* out = _model.layers().back()->get_act().data;
+        for (Index j{ 0 }; j < n; j++) {
+            result_t result(_model.out_shape());
+            std::copy_n(out + j * _out_size, _out_size, result.data());
+            requests[j].result.set_value(std::move(result));
+        }
+    }
+
+    void serve() {
+        std::vector<Request> requests;
+        requests.reserve(_max_batch);
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _ready.wait(lock, [this]() { return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+            // wait for more requests until the oldest one is due
+            const clock::time_point due = _queue.front().arrival + _max_delay;
+            _ready.wait_until(lock, due, [this]() {
+                return _stop || static_cast<Index>(_queue.size()) >= _max_batch;
+            });
+            const Index n = std::min<Index>(_max_batch, static_cast<Index>(_queue.size()));
+            for (Index j{ 0 }; j < n; j++) {
+                requests.push_back(std::move(_queue.front()));
+                _queue.pop_front();
+            }
+            lock.unlock();
+            run_batch(requests);
+            requests.clear();
+            lock.lock();
+        }
+    }
+public:
+    InferenceEngine(Sequential2<num_dims_in, num_dims_out>& model, Index max_batch,
+        std::chrono::microseconds max_delay)
+        :_model{ model }, _max_batch{ max_batch }, _max_delay{ max_delay }
+    {
+        for (Index d : model.in_shape()) {
+            _in_size *= d;
+        }
+        for (Index d : model.out_shape()) {
+            _out_size *= d;
+        }
+        _worker = std::thread(&InferenceEngine::serve, this);
+    }
+
+    InferenceEngine(const InferenceEngine&) = delete;
+    InferenceEngine& operator=(const InferenceEngine&) = delete;
+
+    // Requests still queued are served before the worker stops
+    ~InferenceEngine() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _ready.notify_all();
+        _worker.join();
+    }
+
+    std::future<result_t> submit(sample_t sample) {
+        if (sample.size() != _in_size) {
+            throw std::invalid_argument("Sample does not match the model input");
+        }
+        Request request{ std::move(sample), {}, clock::now() };
+        std::future<result_t> result = request.result.get_future();
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(std::move(request));
+            // the worker only needs waking for the first request of a
+            // batch and when a batch is complete
+            wake = _queue.size() == 1 || static_cast<Index>(_queue.size()) >= _max_batch;
+        }
+        _requests++;
+        if (wake) {
+            _ready.notify_one();
+        }
+        return result;
+    }
+
+    Stats stats() const {
+        return { _requests.load(), _batches.load() };
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <cmath>
 #include <functional>
+#include <string_view>
 #include "typedefs.h"
 
 // helper functions
@@ -38,21 +39,76 @@ void tanh_grad_fun(const Tensor<Scalar, 2>& input, Tensor<float, 2>& output, Thr
     output.device(*device) = (Scalar(1.0f) - output * output).eval();
 }
 
+namespace internal
+{
+// Softmax of a single column: out = exp(z - max) / sum, returns the
+// log-normalizer max + log(sum) so callers can form log-probabilities
+template<typename Scalar>
+Scalar softmax_column(const Scalar* z, Scalar* out, Index rows) {
+    const Map<const Array<Scalar, Dynamic, 1>> zc(z, rows);
+    Map<Array<Scalar, Dynamic, 1>> oc(out, rows);
+    const Scalar zmax = zc.maxCoeff();
+    oc = (zc - zmax).exp();
+    const Scalar sum = oc.sum();
+    oc *= Scalar(1.0f) / sum;
+    return zmax + std::log(sum);
+}
+
+template<typename Scalar>
+TensorOpCost softmax_column_cost(Index rows) {
+    const double bytes = static_cast<double>(rows * sizeof(Scalar));
+    return TensorOpCost(bytes, bytes, 
+        rows * (functor_traits<scalar_exp_op<Scalar>>::Cost + 3));
+}
+}
+
+// Columns are independent samples, each one is reduced and normalized 
+// while it is still in cache instead of doing one device pass per op
 template<typename ArgType1, typename ArgType2>
 void
 softmax_fun(ArgType1& input, ArgType2& output, ThreadPoolDevice* device) {
-    assert(internal::traits<ArgType1>::NumDimensions == 2);
-    assert(internal::traits<ArgType2>::NumDimensions == 2);
-    const DSizes<Index, 1> along_batch{ 0 };
-    const DSizes<Index, 2> reshape_dims{ 1, input.dimension(1) };
-    const DSizes<Index, 2> batch_dims{ input.dimension(0), 1 };
-
-    output.device(*device)
-        = (input - input.maximum(along_batch).eval()
-            .reshape(reshape_dims).broadcast(batch_dims)).exp();
-    output.device(*device) = (output * output.sum(along_batch)
-        .inverse().eval().reshape(reshape_dims)
-        .broadcast(batch_dims).eval());
+    static_assert(internal::traits<ArgType1>::NumDimensions == 2);
+    static_assert(internal::traits<ArgType2>::NumDimensions == 2);
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    const Index rows = input.dimension(0);
+    const Scalar* in_ptr = input.data();
+    Scalar* out_ptr = output.data();
+
+    device->parallelFor(input.dimension(1), 
+        internal::softmax_column_cost<Scalar>(rows),
+        [in_ptr, out_ptr, rows](Index first, Index last) {
+            for (Index j{ first }; j < last; j++) {
+                internal::softmax_column(in_ptr + j * rows, 
+                    out_ptr + j * rows, rows);
+            }
+        });
+}
+
+// Same as softmax_fun but also stores log-probabilities (z - logsumexp),
+// which keeps the cross-entropy finite when a probability underflows
+template<typename ArgType1, typename ArgType2, typename ArgType3>
+void
+log_softmax_fun(ArgType1& input, ArgType2& output, ArgType3& log_output,
+    ThreadPoolDevice* device) {
+    static_assert(internal::traits<ArgType1>::NumDimensions == 2);
+    typedef typename internal::traits<ArgType1>::Scalar Scalar;
+    const Index rows = input.dimension(0);
+    const Scalar* in_ptr = input.data();
+    Scalar* out_ptr = output.data();
+    Scalar* log_ptr = log_output.data();
+
+    device->parallelFor(input.dimension(1), 
+        internal::softmax_column_cost<Scalar>(rows),
+        [in_ptr, out_ptr, log_ptr, rows](Index first, Index last) {
+            for (Index j{ first }; j < last; j++) {
+                const Index off = j * rows;
+                const Scalar log_norm = internal::softmax_column(
+                    in_ptr + off, out_ptr + off, rows);
+                Map<Array<Scalar, Dynamic, 1>>(log_ptr + off, rows) = 
+                    Map<const Array<Scalar, Dynamic, 1>>(in_ptr + off, rows) 
+                    - log_norm;
+            }
+        });
 }
 
 template<typename Scalar>
@@ -62,4 +118,100 @@ void softmax_grad_fun(const Tensor<Scalar, 2>& input, Tensor<Scalar, 2>& grad, T
 }
 
 }
+// -- Element-wise activations of any rank, for fully connected layers and
+// the activation layers after convolutions. bwd multiplies the incoming
+// gradient by the derivative in the same pass. With from_act the 
+// derivative follows from the activation, nothing else is kept for it.
+// They compute in float and write in the scalar of their output
+namespace activation
+{
+
+template<typename Out>
+using scalar_of = typename Eigen::internal::traits<Out>::Scalar;
+
+// sigma' = sigma (1 - sigma)
+struct Sigmoid
+{
+    static constexpr bool from_act = true;
+    static constexpr std::string_view description = "Sigmoid Layer";
+    template<typename In, typename Out>
+    void fwd(const In& z, Out& a, ThreadPoolDevice* device) const {
+        a.device(*device) = cast_to<scalar_of<Out>>(
+            z.unaryExpr(Eigen::internal::scalar_logistic_op<float>()));
+    }
+    template<typename In, typename Grad, typename Out>
+    void bwd(const In& a, const Grad& dy, Out& delta, ThreadPoolDevice* device) const {
+        delta.device(*device) = cast_to<scalar_of<Out>>(dy * a * (1.0f - a));
+    }
+};
+
+// tanh' = 1 - tanh^2
+struct Tanh
+{
+    static constexpr bool from_act = true;
+    static constexpr std::string_view description = "Tanh Layer";
+    template<typename In, typename Out>
+    void fwd(const In& z, Out& a, ThreadPoolDevice* device) const {
+        a.device(*device) = cast_to<scalar_of<Out>>(
+            z.unaryExpr(Eigen::internal::scalar_tanh_op<float>()));
+    }
+    template<typename In, typename Grad, typename Out>
+    void bwd(const In& a, const Grad& dy, Out& delta, ThreadPoolDevice* device) const {
+        delta.device(*device) = cast_to<scalar_of<Out>>(dy * (1.0f - a * a));
+    }
+};
+
+struct ReLU
+{
+    static constexpr bool from_act = true;
+    static constexpr std::string_view description = "ReLU Layer";
+    template<typename In, typename Out>
+    void fwd(const In& z, Out& a, ThreadPoolDevice* device) const {
+        a.device(*device) = cast_to<scalar_of<Out>>(z.cwiseMax(0.0f));
+    }
+    template<typename In, typename Grad, typename Out>
+    void bwd(const In& a, const Grad& dy, Out& delta, ThreadPoolDevice* device) const {
+        delta.device(*device) = cast_to<scalar_of<Out>>(
+            (a > 0.0f).select(dy, dy.constant(0.0f)));
+    }
+};
+
+// the slope keeps the sign of the inputs, so the activation is the mask
+struct LeakyReLU
+{
+    static constexpr bool from_act = true;
+    static constexpr std::string_view description = "Leaky ReLU Layer";
+    float slope{ 0.01f };
+    template<typename In, typename Out>
+    void fwd(const In& z, Out& a, ThreadPoolDevice* device) const {
+        a.device(*device) = cast_to<scalar_of<Out>>((z > 0.0f).select(z, z * slope));
+    }
+    template<typename In, typename Grad, typename Out>
+    void bwd(const In& a, const Grad& dy, Out& delta, ThreadPoolDevice* device) const {
+        delta.device(*device) = cast_to<scalar_of<Out>>((a > 0.0f).select(dy, dy * slope));
+    }
+};
+
+// z Phi(z) with the exact normal cdf, its derivative Phi(z) + z phi(z)
+// needs the inputs
+struct GELU
+{
+    static constexpr bool from_act = false;
+    static constexpr std::string_view description = "GELU Layer";
+    static constexpr float sqrt1_2 = 0.70710678f;
+    static constexpr float inv_sqrt_2pi = 0.39894228f;
+    template<typename In, typename Out>
+    void fwd(const In& z, Out& a, ThreadPoolDevice* device) const {
+        a.device(*device) = cast_to<scalar_of<Out>>(z * ((z * sqrt1_2).erf() + 1.0f) * 0.5f);
+    }
+    template<typename In, typename Grad, typename Out>
+    void bwd(const In& z, const Grad& dy, Out& delta, ThreadPoolDevice* device) const {
+        delta.device(*device) = cast_to<scalar_of<Out>>(
+            dy * (((z * sqrt1_2).erf() + 1.0f) * 0.5f
+            + z * (z.square() * -0.5f).exp() * inv_sqrt_2pi));
+    }
+};
+
+}
+
 #endif
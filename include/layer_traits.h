@@ -7,13 +7,15 @@
 template<class Derived>
 struct traits {};
 
-// Layer traits
+// Layer traits, mixed_precision layers keep their activation and gradient
+// as storage_t
 class FCLayer;
 template<> struct traits<FCLayer>
 {
     typedef std::array<Index, 1> out_shape_t;
     typedef std::array<Index, 1> in_shape_t;
     const static bool trainable = true;
+    const static bool mixed_precision = false;
     const static size_t NumDimensions = 2;
     inline constexpr static std::string_view description = "Fully Connected Layer";
 };
@@ -24,6 +26,7 @@ template<size_t N> struct traits<InputLayer<N>>
     typedef std::array<Index, N> out_shape_t;
     typedef std::array<Index, N> in_shape_t;
     const static bool trainable = false;
+    const static bool mixed_precision = false;
     const static size_t NumDimensions {N};
     inline constexpr static std::string_view description = "Input Layer";
 };
@@ -34,6 +37,7 @@ template<size_t N> struct traits<OutputLayer<N>>
     typedef std::array<Index, N> out_shape_t;
     typedef std::array<Index, N> in_shape_t;
     const static bool trainable = false;
+    const static bool mixed_precision = false;
     const static size_t NumDimensions {N};
     inline constexpr static std::string_view description = "Output Layer";
 };
@@ -44,6 +48,7 @@ template<size_t N_in, size_t N_out> struct traits<ReshapeLayer<N_in, N_out>>
     typedef std::array<Index, N_out> out_shape_t;
     typedef std::array<Index, N_in> in_shape_t;
     const static bool trainable = false;
+    const static bool mixed_precision = false;
     const static size_t NumDimensions {N_out};
     inline constexpr static std::string_view description = "Reshape Layer";
 };
@@ -54,6 +59,7 @@ template<> struct traits<FlattenLayer>
     typedef std::array<Index, 1> out_shape_t;
     typedef std::array<Index, 1> in_shape_t;
     const static bool trainable = false;
+    const static bool mixed_precision = false;
     const static size_t NumDimensions = 1;
     inline constexpr static std::string_view description = "Flatten Layer";
 };
@@ -64,6 +70,7 @@ template<> struct traits<ConvolLayer>
     typedef std::array<Index, 4> out_shape_t;
     typedef std::array<Index, 4> in_shape_t;
     const static bool trainable = true;
+    const static bool mixed_precision = true;
     const static size_t NumDimensions = 4;
     inline constexpr static std::string_view description = "Convolutional Layer";
 };
@@ -74,10 +81,33 @@ template<> struct traits<PoolingLayer>
     typedef std::array<Index, 4> out_shape_t;
     typedef std::array<Index, 4> in_shape_t;
     const static bool trainable = false;
+    const static bool mixed_precision = true;
     const static size_t NumDimensions = 4;
     inline constexpr static std::string_view description = "Pooling Layer";
 };
 
+template<class Op, size_t N> class ActivationLayer;
+template<class Op, size_t N> struct traits<ActivationLayer<Op, N>>
+{
+    typedef std::array<Index, N> out_shape_t;
+    typedef std::array<Index, N> in_shape_t;
+    const static bool trainable = false;
+    const static bool mixed_precision = N == 4;
+    const static size_t NumDimensions {N};
+    inline constexpr static std::string_view description = Op::description;
+};
+
+template<size_t N> class BatchNormLayer;
+template<size_t N> struct traits<BatchNormLayer<N>>
+{
+    typedef std::array<Index, N> out_shape_t;
+    typedef std::array<Index, N> in_shape_t;
+    const static bool trainable = true;
+    const static bool mixed_precision = N == 4;
+    const static size_t NumDimensions = 1;
+    inline constexpr static std::string_view description = "Batch Norm Layer";
+};
+
 // Cost Function traits
 class MSE;
 template<> struct traits <MSE>
@@ -2,12 +2,16 @@
 #define LAYERS_H
 
 #include<random>
+#include <memory>
+#include <vector>
 #include <string_view>
 #include "Tensor.h"
 #include "typedefs.h"
 #include "eigenFuns.h"
 #include "layer_traits.h"
+#include "layer_activations.h"
 #include "costs.h"
+#include "sparse.h"
 
 inline const std::array<int, 1> dims_colwise {0};
 inline const std::array<int, 1> dims_rowwise {1};
@@ -15,6 +19,26 @@ inline const std::array<int, 1> dims_rowwise {1};
 inline std::random_device rd{};
 inline std::mt19937 gen{rd()};
 
+// Work of one forward and one backward pass over the current batch, 
+// estimated from the layer shapes
+struct LayerWork
+{
+    double fwd_flops{ 0.0 };
+    double fwd_bytes{ 0.0 };
+    double bwd_flops{ 0.0 };
+    double bwd_bytes{ 0.0 };
+};
+
+// Bytes a layer holds for the current batch. Parameters and their
+// gradients are its slices of the model's flat buffers
+struct LayerMemory
+{
+    size_t activation{ 0 };
+    size_t gradient{ 0 };
+    size_t weights{ 0 };
+    size_t scratch{ 0 };
+};
+
 class BaseLayer
 {
 public:
@@ -24,6 +48,12 @@ public:
     BaseLayer* _next = nullptr;
     BaseLayer* _prev = nullptr;
     std::string _descriptor;
+    // Backward passes add the parameter gradients to the bound buffers
+    // instead of overwriting them, see Sequential2::accumulate
+    bool _accumulate = false;
+    // Set by Sequential2::training, layers with batch statistics use
+    // them instead of their running averages
+    bool _training = false;
 
     BaseLayer* next();
     BaseLayer* prev();
@@ -34,20 +64,77 @@ public:
     virtual void fwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr) = 0;
     virtual void bwd(ThreadPoolDevice* device=nullptr) = 0;
     virtual void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr) = 0;
+    // Waits for the parameter gradients a bwd left computing on the
+    // device, its input gradient is always complete when bwd returns
+    virtual void sync() {}
+    // Forward pass reading a sparse batch instead of the previous layer, 
+    // only layers that can be first after the input implement it
+    virtual void fwdSparse(const SparseBatch&, ThreadPoolDevice* device=nullptr);
 
     virtual void init(Index) = 0;
     virtual void initParams() = 0;
+    // Frees what init allocated until init runs again
+    virtual void release() = 0;
 
     virtual TensorWrapper<float> get_act() = 0;
     virtual TensorWrapper<float> get_grad() = 0;
+    // Activation and gradient of layers that keep them as storage_t with
+    // NNN_MIXED_PRECISION, get_act/get_grad have no data then. Read either
+    // through visit_act/visit_grad
+    virtual TensorWrapper<storage_t> get_stored_act() { return {nullptr, 0}; }
+    virtual TensorWrapper<storage_t> get_stored_grad() { return {nullptr, 0}; }
     virtual TensorShape in_shape() = 0; 
     virtual TensorShape out_shape() = 0; 
+    // Layers whose activation and gradient are their neighbours' buffers
+    // seen with another shape, their fwd/bwd have nothing to do
+    virtual bool is_view() { return false; }
+    virtual LayerWork work() { return {}; }
+    virtual LayerMemory memory() = 0;
+    // Unlinked copy with its own activations and scratch that shares the
+    // parameters, its views still point into the same flat buffers
+    virtual BaseLayer* clone() = 0;
 
     virtual ~BaseLayer() = default;
 
-    virtual void update(float rate, float mu, float size) = 0; 
+    // Views of the trainable tensors, updated in place by an Optimizer
+    virtual std::vector<Parameter> parameters() = 0;
+    // Number of floats the layer needs in the model's flat parameter
+    // (and gradient) buffer, known once initParams has run
+    virtual Index num_params() = 0;
+    virtual void bindParams(float* params, float* grads) = 0;
+    // Random initialization of the bound parameters
+    virtual void resetParams() = 0;
+    // Merges the layer into the next computing one for inference, it is
+    // a view afterwards. False when the next layer cannot absorb it
+    virtual bool fold() { return false; }
 };
 
+// Calls f with the activation (gradient) of layer as a TensorWrapper of
+// float, or of storage_t when the layer keeps it so
+template<typename F>
+void visit_act(BaseLayer* layer, F&& f){
+#ifdef NNN_MIXED_PRECISION
+    TensorWrapper<storage_t> stored = layer->get_stored_act();
+    if(stored.data != nullptr){
+        f(stored);
+        return;
+    }
+#endif
+    f(layer->get_act());
+}
+
+template<typename F>
+void visit_grad(BaseLayer* layer, F&& f){
+#ifdef NNN_MIXED_PRECISION
+    TensorWrapper<storage_t> stored = layer->get_stored_grad();
+    if(stored.data != nullptr){
+        f(stored);
+        return;
+    }
+#endif
+    f(layer->get_grad());
+}
+
 template<class Derived>
 class Layer: public BaseLayer
 {
@@ -59,20 +146,29 @@ protected:
     using in_batch_shape_t = std::array<Index, 
                 std::tuple_size<in_shape_t>{} + 1>;
     const size_t num_dims {traits<Derived>::NumDimensions};
-    using out_t = Tensor<float, std::tuple_size<out_shape_t>{}+1>;
-    using in_t = Tensor<float, std::tuple_size<in_shape_t>{}+1>;
+    // scalar of _act and _grad
+    using act_scalar_t = std::conditional_t<traits<Derived>::mixed_precision, 
+        storage_t, float>;
+    static constexpr bool stores_narrow = !std::is_same_v<act_scalar_t, float>;
+    using out_t = Tensor<act_scalar_t, std::tuple_size<out_shape_t>{}+1>;
+    using in_t = Tensor<act_scalar_t, std::tuple_size<in_shape_t>{}+1>;
+    using stash_t = Tensor<storage_t, std::tuple_size<out_shape_t>{}+1>;
     using weight_t = Tensor<float, traits<Derived>::NumDimensions>;
     using bias_t = Tensor<float, 1>;
     using nabla_weight_t = Tensor<float, traits<Derived>::NumDimensions>;
-    using nabla_b_t = Tensor<float, 2>;
+    using weight_shape_t = std::array<Index, traits<Derived>::NumDimensions>;
     bool _trainable = traits<Derived>::trainable;
     out_t _act;
     in_t _grad;
-    in_t _winputs;
-    weight_t _weights;
-    bias_t _biases;
-    nabla_weight_t _nabla_w;
-    nabla_b_t _nabla_b;
+    // weighted inputs saved for the backward pass
+    stash_t _winputs;
+    // Views into the model's flat parameter and gradient buffers
+    weight_shape_t _weight_shape{};
+    Index _bias_size{ 0 };
+    TensorMap<weight_t> _weights{ nullptr, weight_shape_t{} };
+    TensorMap<bias_t> _biases{ nullptr, std::array<Index, 1>{} };
+    TensorMap<nabla_weight_t> _nabla_w{ nullptr, weight_shape_t{} };
+    TensorMap<bias_t> _nabla_bias{ nullptr, std::array<Index, 1>{} };
     out_shape_t _out_shape;
     in_shape_t _in_shape;
     out_batch_shape_t _out_batch_shape;
@@ -104,18 +200,78 @@ public:
             _in_batch_shape.begin());
     }    
     TensorWrapper<float> get_act(){
-        return TensorWrapper(_act);
+        if constexpr (stores_narrow){
+            return {nullptr, 0};
+        }else{
+            return TensorWrapper(_act);
+        }
     }
     TensorWrapper<float> get_grad(){
-        return TensorWrapper(_grad);
-    }
-    // TODO: updating method should be specific to optimization strategy,
-    // this should not be here
-    void update(float rate, float mu, float size){
-        if(_trainable){
-            _weights = (1 - rate * mu / size) * _weights.eval()- (rate / size) * _nabla_w;
-            _biases -= (rate / size) * (_nabla_b.sum(dims_rowwise));
+        if constexpr (stores_narrow){
+            return {nullptr, 0};
+        }else{
+            return TensorWrapper(_grad);
+        }
+    }
+    TensorWrapper<storage_t> get_stored_act(){
+        if constexpr (stores_narrow){
+            return TensorWrapper(_act);
+        }else{
+            return {nullptr, 0};
+        }
+    }
+    TensorWrapper<storage_t> get_stored_grad(){
+        if constexpr (stores_narrow){
+            return TensorWrapper(_grad);
+        }else{
+            return {nullptr, 0};
+        }
+    }
+    std::vector<Parameter> parameters(){
+        std::vector<Parameter> params;
+        if(!_trainable){
+            return params;
+        }
+        if(_weights.size() > 0){
+            params.push_back({TensorWrapper(_weights), TensorWrapper(_nabla_w), true});
+        }
+        if(_biases.size() > 0){
+            params.push_back({TensorWrapper(_biases), TensorWrapper(_nabla_bias), false});
+        }
+        return params;
+    }
+    Index num_params(){
+        Index weight_size{ _trainable };
+        for(Index d : _weight_shape){
+            weight_size *= d;
         }
+        return aligned_size(weight_size) + aligned_size(_trainable * _bias_size);
+    }
+    void bindParams(float* params, float* grads){
+        if(!_trainable){
+            return;
+        }
+        const Index bias_offset = num_params() - aligned_size(_bias_size);
+        rebind(_weights, params, _weight_shape);
+        rebind(_nabla_w, grads, _weight_shape);
+        rebind(_biases, params + bias_offset, std::array<Index, 1>{_bias_size});
+        rebind(_nabla_bias, grads + bias_offset, std::array<Index, 1>{_bias_size});
+    }
+    void resetParams(){}
+    void release(){
+        _act = out_t();
+        _grad = in_t();
+        _winputs = stash_t();
+    }
+    // Tensors not allocated by a layer (views, aliases) have no elements
+    LayerMemory memory(){
+        LayerMemory m;
+        const size_t params = static_cast<size_t>(num_params()) * sizeof(float);
+        m.activation = _act.size() * sizeof(act_scalar_t);
+        m.gradient = _grad.size() * sizeof(act_scalar_t) + params;
+        m.weights = params;
+        m.scratch = _winputs.size() * sizeof(storage_t);
+        return m;
     }
     TensorShape in_shape(){
         return TensorShape(_in_shape);
@@ -131,19 +287,26 @@ public:
         assert(_next != nullptr);
         return _next->in_shape().get<out_shape_t>();
     }
-    auto prev_act(){
+    // Call f with the previous activation (next gradient) mapped to shape,
+    // the batch shape by default, as float or as storage_t. Kernels widen
+    // it with cast_to<float>
+    template<typename Shape, typename F>
+    void with_prev_act(const Shape& shape, F&& f){
         assert(_prev != nullptr);
-        return _prev->get_act().get(_in_batch_shape);
+        visit_act(_prev, [&](auto act){ f(act.get(shape)); });
     }
-
-    auto prev_act_flat() {
-        assert(_prev != nullptr);
-        return _prev->get_act().get();
+    template<typename F>
+    void with_prev_act(F&& f){
+        with_prev_act(_in_batch_shape, f);
     }
-
-    auto next_grad(){
+    template<typename Shape, typename F>
+    void with_next_grad(const Shape& shape, F&& f){
         assert(_next != nullptr);
-        return _next->get_grad().get(_out_batch_shape);
+        visit_grad(_next, [&](auto grad){ f(grad.get(shape)); });
+    }
+    template<typename F>
+    void with_next_grad(F&& f){
+        with_next_grad(_out_batch_shape, f);
     }
     
     TensorWrapper<float> prev_act_wrap() {
@@ -153,30 +316,43 @@ public:
 
     TensorWrapper<float> next_grad_wrap() {
         assert(_next != nullptr);
-        return _prev->get_grad();
+        return _next->get_grad();
+    }
+
+    TensorWrapper<storage_t> prev_stored_act() {
+        assert(_prev != nullptr);
+        return _prev->get_stored_act();
+    }
+
+    TensorWrapper<storage_t> next_stored_grad() {
+        assert(_next != nullptr);
+        return _next->get_stored_grad();
     }
 };
 
 template<size_t N>
 class InputLayer: public Layer<InputLayer<N>>
 {
-    typedef typename traits<InputLayer<N>>::out_shape_t out_shape_t;
-    using out_t = Tensor<float, std::tuple_size<out_shape_t>{}+1>;
+    // the batch being propagated, used in place instead of copied
+    TensorWrapper<float> _input{ nullptr, 0 };
 public:
     const size_t _size = 0;
     InputLayer(std::array<Index, N> shape):
         Layer<InputLayer<N>>{shape, shape}
     {
     }
+    BaseLayer* clone(){ return new InputLayer(*this); }
     void init(Index n_samples){
         this->_out_batch_shape.back() = n_samples;
         this->_in_batch_shape.back() = n_samples;
-        this->_act = out_t(this->_out_batch_shape);
     }
     void initParams(){}
+    TensorWrapper<float> get_act(){
+        return _input;
+    }
     void fwd(ThreadPoolDevice* device=nullptr){}
     void fwd(TensorWrapper<float>&& input, ThreadPoolDevice* device=nullptr){
-        this->_act = input.get(this->_in_batch_shape);
+        _input = input;
     }
     void bwd(ThreadPoolDevice* device=nullptr){};
     void bwd(TensorWrapper<float>&& output, ThreadPoolDevice* device=nullptr){};
@@ -188,25 +364,72 @@ class OutputLayer: public Layer<OutputLayer<N>>
     typedef typename traits<InputLayer<N>>::out_shape_t out_shape_t;
     using out_t = Tensor<float, std::tuple_size<out_shape_t>{}+1>;
     CostFun* _cost;
+    // the cost of a model belongs to the model, clones own theirs
+    bool _owns_cost{ false };
+    // previous activation widened to float when it is stored as storage_t
+    Tensor<float, 1> _widened;
+
+    TensorWrapper<float> prev_float(){
+        if(_widened.size() > 0){
+            return TensorWrapper(_widened);
+        }
+        return this->prev_act_wrap();
+    }
 public:
     const size_t _size = 0;
     OutputLayer(std::array<Index, N> shape, CostFun* cost):
         Layer<OutputLayer<N>>{shape, shape}, _cost{cost}
     {
     }
+    ~OutputLayer(){
+        if(_owns_cost){
+            delete _cost;
+        }
+    }
+    // costs keep state between act() and grad(), so clones get a copy
+    BaseLayer* clone(){
+        OutputLayer* copy = new OutputLayer(*this);
+        copy->_cost = _cost->clone();
+        copy->_owns_cost = true;
+        return copy;
+    }
     void init(Index n_samples){
         this->_out_batch_shape.back() = n_samples;
         this->_in_batch_shape.back() = n_samples;
-        this->_act = out_t(_out_batch_shape);
+        if(!_cost->identity_act()){
+            this->_act = out_t(_out_batch_shape);
+        }
         this->_grad = in_t(_in_batch_shape);
         _cost->init(TensorShape(_out_batch_shape));
     }
     void initParams(){}
+    LayerMemory memory(){
+        LayerMemory m = Layer<OutputLayer<N>>::memory();
+        m.activation += _widened.size() * sizeof(float);
+        m.scratch += _cost->bytes();
+        return m;
+    }
+    void release(){
+        Layer<OutputLayer<N>>::release();
+        _widened = Tensor<float, 1>();
+    }
+    TensorWrapper<float> get_act(){
+        if(_cost->identity_act()){
+            return prev_float();
+        }
+        return TensorWrapper(this->_act);
+    }
     void fwd(ThreadPoolDevice* device=nullptr){
-        _cost->act(this->prev_act_wrap(), TensorWrapper<float>(this->_act),
+        TensorWrapper<storage_t> stored = this->prev_stored_act();
+        if(stored.data != nullptr){
+            _widened.resize(static_cast<Index>(stored._size));
+            _widened.device(*device) = stored.get().template cast<float>();
+        }
+        if(_cost->identity_act()){
+            return;
+        }
+        _cost->act(prev_float(), TensorWrapper<float>(this->_act),
             device);
-        //std::cout << this->_act.dimensions() << "\n\n";
-        //std::cout << this->_act.chip(0, N) << "\n\n";
     }
     void fwd(TensorWrapper<float>&& input, ThreadPoolDevice* device=nullptr){}
     void bwd(ThreadPoolDevice* device=nullptr){};
@@ -234,6 +457,7 @@ class ReshapeLayer: public Layer<ReshapeLayer<N_in, N_out>>
 public:
     ReshapeLayer(std::array<Index, N_out> out_shape) 
         :Layer<ReshapeLayer<N_in, N_out>>{out_shape}{}
+    BaseLayer* clone(){ return new ReshapeLayer(*this); }
     void init(Index batch_size){
         this->_out_batch_shape.back() = batch_size;
         this->_in_batch_shape.back() = batch_size;
@@ -244,17 +468,24 @@ public:
         std::copy(this->_in_shape.begin(), this->_in_shape.end(), 
             this->_in_batch_shape.begin());
     }
-    void fwd(ThreadPoolDevice* device=nullptr){
-        this->_act = this->prev_act()
-            .reshape(this->_out_batch_shape);  
-        //imwrite(this->_act.chip(0, 4).chip(0, 3).chip(0, 0), "./_orig1");
-        //imwrite(this->_act.chip(5, 4).chip(0, 3).chip(0, 0), "./_orig2");
+    // Column-major data keeps its order when reshaped, so the previous
+    // activation and the next gradient are used without copies
+    TensorWrapper<float> get_act(){
+        return this->prev_act_wrap();
+    }
+    TensorWrapper<float> get_grad(){
+        return this->next_grad_wrap();
+    }
+    TensorWrapper<storage_t> get_stored_act(){
+        return this->prev_stored_act();
+    }
+    TensorWrapper<storage_t> get_stored_grad(){
+        return this->next_stored_grad();
     }
+    bool is_view(){ return true; }
+    void fwd(ThreadPoolDevice* device=nullptr){}
     void fwd(TensorWrapper<float>&& input, ThreadPoolDevice* device=nullptr){}
-    void bwd(ThreadPoolDevice* device=nullptr){
-        this->_grad = this->next_grad()
-            .reshape(this->_in_batch_shape);  
-    };
+    void bwd(ThreadPoolDevice* device=nullptr){};
     void bwd(TensorWrapper<float>&& output, ThreadPoolDevice* device=nullptr){}
 };
 
@@ -263,6 +494,7 @@ class FlattenLayer: public Layer<FlattenLayer>
 public:
     FlattenLayer() 
         :Layer<FlattenLayer>{}{}
+    BaseLayer* clone(){ return new FlattenLayer(*this); }
 
     in_shape_t prev_shape() override{
         assert(_prev != nullptr);
@@ -286,59 +518,143 @@ public:
             this->_out_batch_shape.begin());
     }
 
-    void fwd(ThreadPoolDevice* device=nullptr){
-        this->_act = this->prev_act()
-            .reshape(this->_out_batch_shape);  
+    TensorWrapper<float> get_act(){
+        return this->prev_act_wrap();
     }
-
+    TensorWrapper<float> get_grad(){
+        return this->next_grad_wrap();
+    }
+    TensorWrapper<storage_t> get_stored_act(){
+        return this->prev_stored_act();
+    }
+    TensorWrapper<storage_t> get_stored_grad(){
+        return this->next_stored_grad();
+    }
+    bool is_view(){ return true; }
+    void fwd(ThreadPoolDevice* device=nullptr){}
     void fwd(TensorWrapper<float>&& input, ThreadPoolDevice* device=nullptr){}
-    void bwd(ThreadPoolDevice* device=nullptr){
-        this->_grad = this->next_grad()
-            .reshape(this->_in_batch_shape);  
-    };
+    void bwd(ThreadPoolDevice* device=nullptr){};
     void bwd(TensorWrapper<float>&& output, ThreadPoolDevice* device=nullptr){}
 };
 
 class FCLayer: public Layer<FCLayer>
 {
     std::array<Index, 1> _shape;
+    // set while the layer is fed a sparse batch
+    const SparseBatch* _sparse_input{ nullptr };
+    // errors of the weighted inputs of the batch, the bias gradient is
+    // their sum and is reduced straight into the gradient buffer
+    Tensor<float, 2> _delta;
+    // weight and bias gradients still being computed, see sync
+    std::shared_ptr<Barrier> _pending;
+    Tensor<float, 2>& weighted_inputs();
+    void activate(ThreadPoolDevice*);
+    void deltas(const TensorMap<Tensor<float, 2>>&, ThreadPoolDevice*);
+    void bwd_products(ThreadPoolDevice*);
+protected:
+    // Normal weights and biases of the given deviation
+    void sampleParams(float std);
 public:
     FCLayer(Index size);
     void init(Index batch_size);
     void initParams();
+    void resetParams();
 
     void fwd(ThreadPoolDevice* device=nullptr);
     void bwd(ThreadPoolDevice* device=nullptr);
 
     void fwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr);
     void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr);
+    void sync();
+    void fwdSparse(const SparseBatch&, ThreadPoolDevice* device=nullptr);
+    LayerWork work();
+    LayerMemory memory();
+    void release();
 
     virtual void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*) = 0;
-    virtual void grad_act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*) = 0;
-
-    virtual ~FCLayer() = default;
+    // Deltas from the incoming gradient and the activation derivative at
+    // the weighted inputs, or at the activations with grad_from_act
+    virtual void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*) = 0;
+    // Layers whose derivative follows from their activation keep no
+    // weighted inputs, they are activated in place
+    virtual bool grad_from_act() const { return false; }
+
+    virtual ~FCLayer(){ sync(); }
 };
 
 class SigmoidLayer: public FCLayer
 {
+    activation::Sigmoid _op;
 public:
     SigmoidLayer(Index size); 
+    BaseLayer* clone(){ return new SigmoidLayer(*this); }
+    bool grad_from_act() const { return true; }
     void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
-    void grad_act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
 };
 
 class TanhLayer: public FCLayer
 {
+    activation::Tanh _op;
 public:
+    TanhLayer(Index size); 
+    BaseLayer* clone(){ return new TanhLayer(*this); }
+    bool grad_from_act() const { return true; }
     void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
-    void grad_act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
 };
 
 class SoftMaxLayer: public FCLayer
 {
 public:
+    SoftMaxLayer(Index size); 
+    BaseLayer* clone(){ return new SoftMaxLayer(*this); }
+    bool grad_from_act() const { return true; }
+    void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
+};
+
+class ReLULayer: public FCLayer
+{
+    activation::ReLU _op;
+public:
+    ReLULayer(Index size); 
+    BaseLayer* clone(){ return new ReLULayer(*this); }
+    void resetParams();
+    bool grad_from_act() const { return true; }
+    void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
+};
+
+class LeakyReLULayer: public FCLayer
+{
+    activation::LeakyReLU _op;
+public:
+    LeakyReLULayer(Index size, float slope = 0.01f); 
+    BaseLayer* clone(){ return new LeakyReLULayer(*this); }
+    void resetParams();
+    float slope() const { return _op.slope; }
+    bool grad_from_act() const { return true; }
+    void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
+};
+
+class GELULayer: public FCLayer
+{
+    activation::GELU _op;
+public:
+    GELULayer(Index size); 
+    BaseLayer* clone(){ return new GELULayer(*this); }
+    void resetParams();
     void act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
-    void grad_act(const Tensor<float, 2>&, Tensor<float, 2>&, ThreadPoolDevice*);
+    void grad_act(const Tensor<float, 2>&, const TensorMap<Tensor<float, 2>>&,
+        Tensor<float, 2>&, ThreadPoolDevice*);
 };
 
 class ConvolLayer:public Layer<ConvolLayer>
@@ -347,13 +663,16 @@ private:
     std::array<Index, 3> _shape;
 public:
     ConvolLayer(std::array<Index, 3>);
+    BaseLayer* clone(){ return new ConvolLayer(*this); }
     void init(Index batch_size);
     void initParams();
+    void resetParams();
 
     void fwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr);
     void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr);
     void fwd(ThreadPoolDevice* device=nullptr);
     void bwd(ThreadPoolDevice* device=nullptr);
+    LayerWork work();
 };
 
 class PoolingLayer:public Layer<PoolingLayer>
@@ -365,6 +684,9 @@ private:
     int _i = 0;
 public:
     PoolingLayer(std::array<Index, 2>, Index);
+    BaseLayer* clone(){ return new PoolingLayer(*this); }
+    std::array<Index, 2> window() const { return _shape; }
+    Index stride() const { return _stride; }
     void init(Index batch_size);
     void initParams();
 
@@ -372,8 +694,321 @@ public:
     void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr);
     void fwd(ThreadPoolDevice* device=nullptr);
     void bwd(ThreadPoolDevice* device=nullptr);
+    LayerWork work();
+    LayerMemory memory();
+    void release();
+};
+
+
+
+// -- Element-wise activation on its own, for layouts without a fully
+// connected layer such as convolutions: ActivationLayer<activation::ReLU, 4>
+template<class Op, size_t N>
+class ActivationLayer: public Layer<ActivationLayer<Op, N>>
+{
+    Op _op;
+public:
+    ActivationLayer(Op op = Op{})
+        :Layer<ActivationLayer<Op, N>>{}, _op{ op }{}
+    BaseLayer* clone(){ return new ActivationLayer(*this); }
+    const Op& op() const { return _op; }
+    void initParams(){
+        this->_in_shape = this->prev_shape();
+        this->_out_shape = this->_in_shape;
+        std::copy(this->_in_shape.begin(), this->_in_shape.end(), 
+            this->_in_batch_shape.begin());
+        std::copy(this->_out_shape.begin(), this->_out_shape.end(), 
+            this->_out_batch_shape.begin());
+    }
+    void init(Index batch_size){
+        this->_out_batch_shape.back() = batch_size;
+        this->_in_batch_shape.back() = batch_size;
+        this->_act = typename Layer<ActivationLayer<Op, N>>::out_t(this->_out_batch_shape);
+        this->_grad = typename Layer<ActivationLayer<Op, N>>::in_t(this->_in_batch_shape);
+    }
+    void fwd(ThreadPoolDevice* device=nullptr){
+        this->with_prev_act([&](auto z){
+            _op.fwd(cast_to<float>(z), this->_act, device);
+        });
+    }
+    void bwd(ThreadPoolDevice* device=nullptr){
+        // nothing consumes the gradient of the input layer
+        if(this->_prev->prev() == nullptr){
+            return;
+        }
+        this->with_next_grad([&](auto dy){
+            if constexpr (Op::from_act){
+                _op.bwd(cast_to<float>(this->_act), cast_to<float>(dy), 
+                    this->_grad, device);
+            }else{
+                this->with_prev_act([&](auto z){
+                    _op.bwd(cast_to<float>(z), cast_to<float>(dy), 
+                        this->_grad, device);
+                });
+            }
+        });
+    }
+    void fwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr){}
+    void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr){}
+    LayerWork work(){
+        const double size = static_cast<double>(this->_act.size());
+        const double f = sizeof(typename Layer<ActivationLayer<Op, N>>::act_scalar_t);
+        LayerWork w;
+        w.fwd_flops = size;
+        w.fwd_bytes = 2 * f * size;
+        w.bwd_flops = size;
+        w.bwd_bytes = 3 * f * size;
+        return w;
+    }
 };
 
+// -- Batch normalization
+// Normalizes every channel over the batch, then scales and shifts it by
+// the trainable gamma and beta. N = 1 normalizes the features of fully
+// connected layouts [features, batch], N = 4 the depth of convolutional
+// ones [1, rows, cols, depth, batch]. Both are seen as [inner, channels,
+// batch] so the reductions and the fused normalize, scale and shift pass
+// run on the device. The running mean and variance used out of training
+// are stored after gamma and beta in the flat parameter buffer, so they
+// are saved with checkpoints
+template<size_t N>
+class BatchNormLayer: public Layer<BatchNormLayer<N>>
+{
+    static_assert(N == 1 || N == 4, "Batch norm takes [features] or [1, rows, cols, depth]");
+    typedef Layer<BatchNormLayer<N>> base_t;
+    typedef std::array<Index, 3> cube_t;
+    inline static const Eigen::array<Index, 2> reduce_dims{0, 2};
+
+    const float _momentum;
+    const float _eps;
+    Index _channels{ 0 };
+    Index _inner{ 1 };
+    // [inner, channels, batch], a channel vector and its broadcast
+    cube_t _cube{};
+    cube_t _channel_shape{};
+    cube_t _bcast{};
+    TensorMap<Tensor<float, 1>> _running_mean{ nullptr, std::array<Index, 1>{} };
+    TensorMap<Tensor<float, 1>> _running_var{ nullptr, std::array<Index, 1>{} };
+    // statistics of the last forward pass, per channel
+    Tensor<float, 1> _mean;
+    Tensor<float, 1> _inv_std;
+    Tensor<float, 1> _scale;
+    Tensor<float, 1> _shift;
+    Tensor<float, 1> _sum_dy;
+    Tensor<float, 1> _sum_dyx;
+    bool _batch_stats{ false };
+    bool _folded{ false };
+
+    auto channel(Tensor<float, 1>& v){
+        return v.reshape(_channel_shape).broadcast(_bcast);
+    }
+public:
+    BatchNormLayer(float momentum = 0.1f, float eps = 1e-5f)
+        :base_t{}, _momentum{ momentum }, _eps{ eps }{}
+    BaseLayer* clone(){ return new BatchNormLayer(*this); }
+
+    void initParams(){
+        this->_in_shape = this->prev_shape();
+        this->_out_shape = this->_in_shape;
+        std::copy(this->_in_shape.begin(), this->_in_shape.end(), 
+            this->_in_batch_shape.begin());
+        std::copy(this->_out_shape.begin(), this->_out_shape.end(), 
+            this->_out_batch_shape.begin());
+        _channels = this->_in_shape[N - 1];
+        _inner = 1;
+        for(size_t i{0}; i + 1 < N; i++){
+            _inner *= this->_in_shape[i];
+        }
+        this->_weight_shape = {_channels};
+        this->_bias_size = _channels;
+        _channel_shape = {1, _channels, 1};
+        for(Tensor<float, 1>* v : {&_mean, &_inv_std, &_scale, &_shift, &_sum_dy, &_sum_dyx}){
+            *v = Tensor<float, 1>(_channels);
+        }
+    }
+    void init(Index batch_size){
+        this->_out_batch_shape.back() = batch_size;
+        this->_in_batch_shape.back() = batch_size;
+        _cube = {_inner, _channels, batch_size};
+        _bcast = {_inner, 1, batch_size};
+        if(!_folded){
+            this->_act = typename base_t::out_t(this->_out_batch_shape);
+            this->_grad = typename base_t::in_t(this->_in_batch_shape);
+        }
+    }
+
+    // gamma, beta, running mean and running variance
+    Index num_params(){
+        return 4 * aligned_size(_channels);
+    }
+    void bindParams(float* params, float* grads){
+        const Index stride = aligned_size(_channels);
+        const std::array<Index, 1> shape{_channels};
+        rebind(this->_weights, params, shape);
+        rebind(this->_nabla_w, grads, shape);
+        rebind(this->_biases, params + stride, shape);
+        rebind(this->_nabla_bias, grads + stride, shape);
+        rebind(_running_mean, params + 2 * stride, shape);
+        rebind(_running_var, params + 3 * stride, shape);
+    }
+    void resetParams(){
+        this->_weights.setConstant(1.0f);
+        this->_biases.setZero();
+        _running_mean.setZero();
+        _running_var.setConstant(1.0f);
+    }
+    // gamma and beta are not decayed, a folded layer has nothing to train
+    std::vector<Parameter> parameters(){
+        if(_folded){
+            return {};
+        }
+        return {{TensorWrapper(this->_weights), TensorWrapper(this->_nabla_w), false},
+            {TensorWrapper(this->_biases), TensorWrapper(this->_nabla_bias), false}};
+    }
+
+    bool is_view(){ return _folded; }
+    TensorWrapper<float> get_act(){
+        return _folded ? this->prev_act_wrap() : base_t::get_act();
+    }
+    TensorWrapper<float> get_grad(){
+        return _folded ? this->next_grad_wrap() : base_t::get_grad();
+    }
+    TensorWrapper<storage_t> get_stored_act(){
+        return _folded ? this->prev_stored_act() : base_t::get_stored_act();
+    }
+    TensorWrapper<storage_t> get_stored_grad(){
+        return _folded ? this->next_stored_grad() : base_t::get_stored_grad();
+    }
+
+    void fwd(ThreadPoolDevice* device=nullptr){
+        this->with_prev_act(_cube, [&](auto x_in){
+            normalize(cast_to<float>(x_in), device);
+        });
+    }
+
+    // dgamma = sum(dy * xhat), dbeta = sum(dy), and with batch statistics
+    // dx = gamma * inv_std * (dy - (dbeta + xhat * dgamma) / n), the 
+    // normalized input xhat is recomputed from the input instead of stored.
+    // The running averages move once per training step here, forward
+    // passes may run again for recomputed activations
+    void bwd(ThreadPoolDevice* device=nullptr){
+        this->with_prev_act(_cube, [&](auto x_in){
+            this->with_next_grad(_cube, [&](auto dy_in){
+                normalize_grad(cast_to<float>(x_in), cast_to<float>(dy_in), device);
+            });
+        });
+    }
+    void fwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr){}
+    void bwd(TensorWrapper<float>&&, ThreadPoolDevice* device=nullptr){}
 
+private:
+    // x and dy as float [inner, channels, batch] expressions
+    template<typename X>
+    void normalize(const X& x, ThreadPoolDevice* device){
+        auto y = TensorWrapper(this->_act).get(_cube);
+        _batch_stats = this->_training;
+        if(_batch_stats){
+            _mean.device(*device) = x.mean(reduce_dims);
+            _inv_std.device(*device) = ((x - channel(_mean)).square().mean(reduce_dims) 
+                + _eps).rsqrt();
+        }else{
+            _mean = _running_mean;
+            _inv_std = (_running_var + _eps).rsqrt();
+        }
+        _scale = this->_weights * _inv_std;
+        _shift = this->_biases - _mean * _scale;
+        y.device(*device) = cast_to<typename base_t::act_scalar_t>(
+            x * channel(_scale) + channel(_shift));
+    }
+    template<typename X, typename DY>
+    void normalize_grad(const X& x, const DY& dy, ThreadPoolDevice* device){
+        const float n = static_cast<float>(_cube[0] * _cube[2]);
+        if(_batch_stats){
+            // unbiased variance
+            const float unbias = n > 1.0f ? n / (n - 1.0f) : 1.0f;
+            _running_mean = (1.0f - _momentum) * _running_mean + _momentum * _mean;
+            _running_var = (1.0f - _momentum) * _running_var 
+                + _momentum * unbias * (_inv_std.square().inverse() - _eps);
+        }
+        _sum_dy.device(*device) = dy.sum(reduce_dims);
+        _sum_dyx.device(*device) = (dy * x).sum(reduce_dims);
+        _sum_dyx = _inv_std * (_sum_dyx - _mean * _sum_dy);
+        if(this->_accumulate){
+            this->_nabla_w += _sum_dyx;
+            this->_nabla_bias += _sum_dy;
+        }else{
+            this->_nabla_w = _sum_dyx;
+            this->_nabla_bias = _sum_dy;
+        }
+        // nothing consumes the gradient of the input layer
+        if(this->_prev->prev() == nullptr){
+            return;
+        }
+        auto dx = TensorWrapper(this->_grad).get(_cube);
+        if(!_batch_stats){
+            dx.device(*device) = cast_to<typename base_t::act_scalar_t>(
+                dy * channel(_scale));
+            return;
+        }
+        // dx = scale * dy + q * x + r per channel
+        _sum_dyx = -_scale * _inv_std * _sum_dyx / n;
+        _shift = -_scale * _sum_dy / n - _sum_dyx * _mean;
+        dx.device(*device) = cast_to<typename base_t::act_scalar_t>(
+            dy * channel(_scale) + x * channel(_sum_dyx) + channel(_shift));
+    }
+
+public:
+    // The normalization is affine out of training and the fully connected
+    // layers apply their activation after the product, so it folds exactly
+    // into the next one: W' = W diag(scale), b' = b + W shift
+    bool fold(){
+        BaseLayer* next = this->_next;
+        while(next != nullptr && next->is_view()){
+            next = next->next();
+        }
+        FCLayer* fc = dynamic_cast<FCLayer*>(next);
+        if(_folded || fc == nullptr){
+            return false;
+        }
+        std::vector<Parameter> params = fc->parameters();
+        const Index out = fc->out_shape().get()[0];
+        const Index in = fc->in_shape().get()[0];
+        assert(in == _inner * _channels);
+        float* w = params[0].value.data;
+        float* b = params[1].value.data;
+        for(Index c{0}; c < _channels; c++){
+            const float scale = this->_weights(c) / std::sqrt(_running_var(c) + _eps);
+            const float shift = this->_biases(c) - _running_mean(c) * scale;
+            for(Index f{c * _inner}; f < (c + 1) * _inner; f++){
+                for(Index o{0}; o < out; o++){
+                    b[o] += w[o + f * out] * shift;
+                    w[o + f * out] *= scale;
+                }
+            }
+        }
+        // an identity, should the parameters be loaded unfolded
+        this->_weights.setConstant(1.0f);
+        this->_biases.setZero();
+        _running_mean.setZero();
+        _running_var.setConstant(1.0f - _eps);
+        _folded = true;
+        this->_act = typename base_t::out_t();
+        this->_grad = typename base_t::in_t();
+        return true;
+    }
+
+    LayerWork work(){
+        const double size = static_cast<double>(_cube[0] * _cube[1] * _cube[2]);
+        const double f = sizeof(typename base_t::act_scalar_t);
+        LayerWork w;
+        // mean, variance and the fused pass
+        w.fwd_flops = (_batch_stats ? 5 : 2) * size;
+        w.fwd_bytes = f * (_batch_stats ? 4 : 2) * size;
+        // two reductions and the input gradient
+        w.bwd_flops = 8 * size;
+        w.bwd_bytes = f * 6 * size;
+        return w;
+    }
+};
 
-#endif
\ No newline at end of file
+#endif
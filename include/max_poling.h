@@ -1,5 +1,5 @@
 
-#include <unsupported/Eigen/CXX11/Tensor>
+#include "typedefs.h"
 
 namespace Eigen
 {
@@ -7,11 +7,13 @@ namespace Eigen
 template<typename ArgType1, typename ArgType2, typename ArgType3>
 void max_pooling(ArgType1& input, Index ir, Index ic, Index depth, Index batch, 
 	Index kr, Index kc, Index stride, ArgType2& output, ArgType3& argmax_out) {
+    // the input is compared as the output scalar, they may differ in width
+    typedef typename internal::traits<ArgType2>::Scalar OutScalar;
 
-    TensorRef<Tensor<float, internal::traits<ArgType2>::NumDimensions,
+    TensorRef<Tensor<OutScalar, internal::traits<ArgType2>::NumDimensions,
                     internal::traits<ArgType2>::Layout, Index>>
         output_ref(output);
-	output.setConstant(Eigen::NumTraits<float>::lowest());
+	output.setConstant(Eigen::NumTraits<OutScalar>::lowest());
 
 	Index outr = output_ref.dimension(1);
 	Index outc = output_ref.dimension(2);
@@ -28,8 +30,9 @@ void max_pooling(ArgType1& input, Index ir, Index ic, Index depth, Index batch,
 					for (Index h{ hstart }; h < hend; h++) {
 						for (Index w{ wstart }; w < wend; w++) {
 							Index idx_flat = r + c * ir + k * ic * ir + i * ic * ir * depth;
-							if (input(idx_flat) > output(0, h, w, k, i)) {
-								output(0, h, w, k, i) = input(idx_flat);
+							const OutScalar value = static_cast<OutScalar>(input(idx_flat));
+							if (value > output(0, h, w, k, i)) {
+								output(0, h, w, k, i) = value;
 								argmax_out(0, h, w, k, i) = idx_flat;
 							}
 						}
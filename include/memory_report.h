@@ -0,0 +1,53 @@
+#ifndef MEMORY_REPORT_H
+#define MEMORY_REPORT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "allocations.h"
+
+namespace mem
+{
+
+enum class Role
+{
+    Activation,
+    Gradient,
+    Weights,
+    Optimizer,
+    Input,
+    Scratch,
+};
+const char* role_name(Role role);
+
+// -- Bytes held by every part of a model, by role
+class MemoryReport
+{
+public:
+    struct Entry
+    {
+        std::string owner;
+        Role role;
+        size_t bytes;
+    };
+    // Average allocations per training step over the last epoch, only
+    // counted when built with NNN_TRACK_ALLOCATIONS
+    double eigen_allocations_per_step{ 0.0 };
+    double heap_allocations_per_step{ 0.0 };
+    double heap_bytes_per_step{ 0.0 };
+private:
+    std::vector<Entry> _entries;
+public:
+    void add(const std::string& owner, Role role, size_t bytes);
+    const std::vector<Entry>& entries() const { return _entries; }
+    size_t total() const;
+    size_t total(Role role) const;
+    size_t total(const std::string& owner) const;
+};
+
+// Table of owners by roles in KB, then the totals and allocations per step
+std::ostream& operator<<(std::ostream& os, const MemoryReport& report);
+
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "typedefs.h"
+
+namespace Eigen
+{
+
+// -- Batched argmax: index of the largest entry of every column
+template<typename ArgType>
+auto
+batch_argmax(const ArgType& t) {
+    return t.argmax(0);
+}
+
+// -- Number of samples (columns) whose predicted class matches the label,
+// evaluated as a single device expression over the whole batch
+template<typename ArgType1, typename ArgType2>
+Index
+count_correct(const ArgType1& pred, const ArgType2& labels, 
+    ThreadPoolDevice* device) {
+    Tensor<Index, 0> correct;
+    correct.device(*device) = (batch_argmax(pred) == batch_argmax(labels))
+        .template cast<Index>().sum();
+    return correct(0);
+}
+
+}
+
+// -- Running loss/accuracy, fed with the outputs of passes that already 
+// happened (e.g. the training forward pass) so it costs no extra forward
+class RunningMetrics
+{
+    double _loss = 0.0;
+    Index _correct = 0;
+    Index _samples = 0;
+public:
+    void reset() {
+        _loss = 0.0;
+        _correct = 0;
+        _samples = 0;
+    }
+
+    template<typename ArgType1, typename ArgType2>
+    void update(const ArgType1& pred, const ArgType2& labels, float loss,
+        ThreadPoolDevice* device) {
+        _loss += loss;
+        _correct += Eigen::count_correct(pred, labels, device);
+        _samples += labels.dimension(1);
+    }
+
+    // mean loss per sample
+    float loss() const {
+        return _samples ? static_cast<float>(_loss / _samples) : 0.0f;
+    }
+
+    float accuracy() const {
+        return _samples ? static_cast<float>(_correct) / _samples : 0.0f;
+    }
+
+    Index samples() const { return _samples; }
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef OPTIMIZERS_H
+#define OPTIMIZERS_H
+
+#include <vector>
+#include "typedefs.h"
+#include "Tensor.h"
+
+namespace optim
+{
+
+// -- Base class
+// Owns the state of every parameter (velocities, moments) in a single
+// contiguous block: slot s of the parameter element g lives at 
+// _state[s * _total + g], g being the position of the element when all 
+// the parameters are laid one after the other.
+class Optimizer
+{
+protected:
+    std::vector<Parameter> _params;
+    std::vector<Index> _offsets;
+    Tensor<float, 1> _state;
+    Index _total{ 0 };
+    Index _t{ 0 };
+
+    // Number of state values per parameter element
+    virtual Index slots() const = 0;
+    // Called once per step before any kernel runs
+    virtual void prepare() {}
+    // Fused update of n contiguous elements, state slots are _total apart.
+    // n is at most one tile, so the statements of a kernel reuse the
+    // values while they are still in cache
+    static constexpr Index tile = 1024;
+    virtual void kernel(float* value, const float* grad, float* state,
+        Index n, float scale, bool decay) const = 0;
+    // Rough number of cycles per element, used to split the work
+    virtual double cost() const = 0;
+public:
+    float lr;
+
+    Optimizer(float rate): lr{ rate } {}
+    virtual ~Optimizer() = default;
+
+    // Binds the optimizer to a set of parameters and resets its state.
+    // The state is kept when bound again to the same parameters, e.g.
+    // after it was restored from a checkpoint
+    void init(const std::vector<Parameter>& params);
+    // Copies a saved state, init() must have been called before
+    void restore(const float* state, Index size, Index steps);
+    const Tensor<float, 1>& state() const { return _state; }
+    // Applies one update to all parameters, scale multiplies the
+    // gradients (e.g. 1 / batch size when they are summed over the batch)
+    void step(float scale, ThreadPoolDevice* device);
+
+    Index steps() const { return _t; }
+    // Estimated work of one step, for profiling
+    double step_flops() const { return cost() * _total; }
+    double step_bytes() const { 
+        return static_cast<double>((3 + 2 * slots()) * sizeof(float)) * _total; 
+    }
+};
+
+// -- Implementations
+
+// w -= lr * (scale * g + weight_decay * w)
+class SGD : public Optimizer
+{
+    float _weight_decay;
+protected:
+    Index slots() const override { return 0; }
+    void kernel(float*, const float*, float*, Index, float, bool) const override;
+    double cost() const override { return 3; }
+public:
+    SGD(float rate, float weight_decay = 0.0f)
+        :Optimizer{ rate }, _weight_decay{ weight_decay } {}
+};
+
+// v = mu * v + g, w -= lr * v  (or lr * (g + mu * v) with Nesterov)
+class Momentum : public Optimizer
+{
+    float _momentum;
+    float _weight_decay;
+    bool _nesterov;
+protected:
+    Index slots() const override { return 1; }
+    void kernel(float*, const float*, float*, Index, float, bool) const override;
+    double cost() const override { return 6; }
+public:
+    Momentum(float rate, float momentum = 0.9f, bool nesterov = false,
+        float weight_decay = 0.0f)
+        :Optimizer{ rate }, _momentum{ momentum }, _weight_decay{ weight_decay },
+        _nesterov{ nesterov } {}
+};
+
+// Weight decay is added to the gradient (L2) unless decoupled (AdamW)
+class Adam : public Optimizer
+{
+    float _beta1;
+    float _beta2;
+    float _eps;
+    float _weight_decay;
+    bool _decoupled;
+    // bias corrections of the current step
+    float _corr1{ 1.0f };
+    float _corr2{ 1.0f };
+protected:
+    Index slots() const override { return 2; }
+    void prepare() override;
+    void kernel(float*, const float*, float*, Index, float, bool) const override;
+    double cost() const override { return 12; }
+public:
+    Adam(float rate = 1e-3f, float beta1 = 0.9f, float beta2 = 0.999f,
+        float eps = 1e-8f, float weight_decay = 0.0f, bool decoupled = false)
+        :Optimizer{ rate }, _beta1{ beta1 }, _beta2{ beta2 }, _eps{ eps },
+        _weight_decay{ weight_decay }, _decoupled{ decoupled } {}
+};
+
+class AdamW : public Adam
+{
+public:
+    AdamW(float rate = 1e-3f, float weight_decay = 1e-2f, float beta1 = 0.9f,
+        float beta2 = 0.999f, float eps = 1e-8f)
+        :Adam{ rate, beta1, beta2, eps, weight_decay, true } {}
+};
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// -- Per-layer profiler
+// Records the wall time of every pass it wraps (steady_clock) together
+// with the FLOPs and bytes the pass is estimated to move, exports them as
+// a Chrome trace (chrome://tracing, Perfetto) or as a text summary.
+class Profiler
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct Event
+    {
+        std::string name;
+        const char* phase;
+        double start_us;
+        double duration_us;
+        double flops;
+        double bytes;
+    };
+private:
+    bool _enabled{ false };
+    clock::time_point _origin{ clock::now() };
+    std::vector<Event> _events;
+
+    double since_origin(clock::time_point t) const {
+        return std::chrono::duration<double, std::micro>(t - _origin).count();
+    }
+public:
+    void enable(bool enabled) { _enabled = enabled; }
+    bool enabled() const { return _enabled; }
+    void reset() {
+        _events.clear();
+        _origin = clock::now();
+    }
+    const std::vector<Event>& events() const { return _events; }
+
+    // Runs f and records it as one event
+    template<typename F>
+    void record(std::string name, const char* phase, double flops, double bytes,
+        F&& f) {
+        const clock::time_point start = clock::now();
+        f();
+        const clock::time_point end = clock::now();
+        _events.push_back({std::move(name), phase, since_origin(start),
+            std::chrono::duration<double, std::micro>(end - start).count(),
+            flops, bytes});
+    }
+
+    void write_chrome_trace(const std::string& path) const;
+    // Totals per layer and phase: calls, time, GFLOP/s and GB/s
+    void summary(std::ostream& os) const;
+};
+
+#endif
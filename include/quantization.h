@@ -0,0 +1,295 @@
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "typedefs.h"
+#include "layers.h"
+#include "metrics.h"
+#include "timer.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define NNN_DPBUSD _mm256_dpbusd_epi32
+#elif defined(__AVXVNNI__)
+#define NNN_DPBUSD _mm256_dpbusd_avx_epi32
+#endif
+
+// -- int8 kernels
+namespace Eigen
+{
+
+// Symmetric quantization, q = round(x / scale) clamped to [-127, 127]
+inline void quantize_s8(const float* in, int8_t* out, Index n, float scale,
+    ThreadPoolDevice* device) {
+    TensorMap<Tensor<const float, 1>> x(in, n);
+    TensorMap<Tensor<int8_t, 1>> q(out, n);
+    q.device(*device) = (x * (1.0f / scale)).round()
+        .cwiseMax(-127.0f).cwiseMin(127.0f).cast<int8_t>();
+}
+
+#if defined(__AVX2__)
+inline int32_t hsum_epi32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+        _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+// int8 x int8 dot product accumulated in int32
+inline int32_t dot_s8(const int8_t* x, const int8_t* w, Index n) {
+    int32_t sum{ 0 };
+    Index i{ 0 };
+#if defined(NNN_DPBUSD)
+    // vpdpbusd multiplies unsigned by signed bytes: x + 128 is fed as
+    // unsigned and 128 * sum(w) is subtracted at the end
+    const __m256i flip = _mm256_set1_epi8(static_cast<char>(0x80));
+    const __m256i ones = _mm256_set1_epi8(1);
+    __m256i acc = _mm256_setzero_si256();
+    __m256i wsum = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32) {
+        const __m256i xv = _mm256_xor_si256(flip,
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        const __m256i wv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+        acc = NNN_DPBUSD(acc, xv, wv);
+        wsum = NNN_DPBUSD(wsum, ones, wv);
+    }
+    sum = hsum_epi32(acc) - 128 * hsum_epi32(wsum);
+#elif defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16) {
+        const __m256i xv = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        const __m256i wv = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xv, wv));
+    }
+    sum = hsum_epi32(acc);
+#endif
+    for (; i < n; i++) {
+        sum += static_cast<int32_t>(x[i]) * static_cast<int32_t>(w[i]);
+    }
+    return sum;
+}
+
+}
+
+// -- Post-training quantization
+// Weights are quantized per output channel, activations per tensor with
+// a scale calibrated on a few batches. Integer products are accumulated
+// in int32 and rescaled to float, so layers without an int8 version
+// (pooling) and the activation functions run on float tensors.
+namespace quant
+{
+
+// Weights of one layer, row r holds output channel r contiguously
+struct QuantizedWeights
+{
+    std::vector<int8_t> data;
+    std::vector<float> scales;
+    Index rows{ 0 };
+    Index cols{ 0 };
+
+    const int8_t* row(Index r) const { return data.data() + r * cols; }
+    size_t bytes() const { return data.size() + scales.size() * sizeof(float); }
+};
+
+// w is column-major [rows, cols], rows being the output channels
+QuantizedWeights quantize_weights(const float* w, Index rows, Index cols);
+
+enum class Activation { none, sigmoid, tanh, softmax, relu, leaky_relu, gelu };
+
+class QuantizedOp
+{
+public:
+    // in holds batch samples of in_size() values, out of out_size()
+    virtual void fwd(const float* in, float* out, Index batch,
+        ThreadPoolDevice* device) = 0;
+    virtual Index in_size() const = 0;
+    virtual Index out_size() const = 0;
+    virtual size_t bytes() const { return 0; }
+    virtual ~QuantizedOp() = default;
+};
+
+class QuantizedFC: public QuantizedOp
+{
+    QuantizedWeights _weights;
+    std::vector<float> _biases;
+    // weight scale times input scale for every output
+    std::vector<float> _out_scales;
+    float _in_scale;
+    Activation _act;
+    // of leaky_relu
+    float _slope;
+    std::vector<int8_t> _xq;
+public:
+    QuantizedFC(const float* weights, const float* biases, Index out_size,
+        Index in_size, float in_scale, Activation act, float slope = 0.0f);
+    void fwd(const float*, float*, Index, ThreadPoolDevice*);
+    Index in_size() const { return _weights.cols; }
+    Index out_size() const { return _weights.rows; }
+    size_t bytes() const { return _weights.bytes() + _biases.size() * sizeof(float); }
+};
+
+// Same convolution as convolveBatch: every input depth is correlated
+// with every kernel, output depth d + depth * k
+class QuantizedConv: public QuantizedOp
+{
+    QuantizedWeights _kernels;
+    std::vector<float> _out_scales;
+    std::array<Index, 4> _in_shape;
+    Index _kr, _kc;
+    float _in_scale;
+    std::vector<int8_t> _xq;
+public:
+    QuantizedConv(const float* kernels, Index depth, Index kr, Index kc,
+        std::array<Index, 4> in_shape, float in_scale);
+    void fwd(const float*, float*, Index, ThreadPoolDevice*);
+    Index in_size() const;
+    Index out_size() const;
+    size_t bytes() const { return _kernels.bytes(); }
+};
+
+class MaxPool: public QuantizedOp
+{
+    std::array<Index, 4> _in_shape;
+    std::array<Index, 4> _out_shape;
+    std::array<Index, 2> _window;
+    Index _stride;
+public:
+    MaxPool(std::array<Index, 4> in_shape, std::array<Index, 4> out_shape,
+        std::array<Index, 2> window, Index stride);
+    void fwd(const float*, float*, Index, ThreadPoolDevice*);
+    Index in_size() const;
+    Index out_size() const;
+};
+
+// Element-wise activation of an ActivationLayer, applied to the float
+// outputs of the op before it with the same functor as the layer
+template<class Op>
+class QuantizedActivation: public QuantizedOp
+{
+    Op _op;
+    Index _size;
+public:
+    QuantizedActivation(Op op, Index size): _op{ op }, _size{ size } {}
+    void fwd(const float* in, float* out, Index batch, ThreadPoolDevice* device) {
+        TensorMap<Tensor<const float, 1>> x(in, _size * batch);
+        TensorMap<Tensor<float, 1>> y(out, _size * batch);
+        _op.fwd(x, y, device);
+    }
+    Index in_size() const { return _size; }
+    Index out_size() const { return _size; }
+};
+
+// int8 version of a layer given the calibrated largest |input|, nullptr
+// for layers that leave the data untouched (reshape, flatten)
+std::unique_ptr<QuantizedOp> quantize_layer(BaseLayer* layer, float amax);
+
+class QuantizedModel
+{
+    std::vector<std::unique_ptr<QuantizedOp>> _ops;
+    Tensor<float, 1> _buffers[2];
+public:
+    void add(std::unique_ptr<QuantizedOp> op);
+    // x holds batch samples, the result is [out_size, batch] and stays
+    // valid until the next call
+    TensorMap<Tensor<float, 2>> fwd(const float* x, Index batch,
+        ThreadPoolDevice* device);
+    Index in_size() const { return _ops.front()->in_size(); }
+    Index out_size() const { return _ops.back()->out_size(); }
+    size_t bytes() const;
+
+    template<class reader>
+    float accuracy(reader& val_reader, ThreadPoolDevice* device) {
+        val_reader.reset();
+        Index sum{ 0 };
+        auto end = val_reader.end();
+        for (auto it = val_reader.begin(); it != end; it++) {
+            decltype(auto) data = it.data();
+            decltype(auto) labels = it.labels();
+            sum += count_correct(fwd(data.data(), labels.dimension(1), device),
+                labels, device);
+        }
+        return static_cast<float>(sum) / static_cast<float>(val_reader.size());
+    }
+};
+
+// Largest |x| at the input of every layer of model over a few batches
+template<class model_t, class reader>
+std::vector<float> calibrate(model_t& model, reader& calib_reader, Index batches) {
+    const std::vector<BaseLayer*>& layers = model.layers();
+    std::vector<float> amax(layers.size(), 0.0f);
+    model.init(calib_reader.batch());
+    calib_reader.reset();
+    Index n{ 0 };
+    auto end = calib_reader.end();
+    for (auto it = calib_reader.begin(); it != end && n < batches; it++, n++) {
+        model.fwdProp(it.data());
+        for (size_t i{ 1 }; i < layers.size(); i++) {
+            Tensor<float, 0> m;
+            visit_act(layers[i - 1], [&](auto act){
+                m.device(*model.device()) = cast_to<float>(act.get()).abs().maximum();
+            });
+            amax[i] = std::max(amax[i], m(0));
+        }
+    }
+    return amax;
+}
+
+template<class model_t, class reader>
+QuantizedModel quantize(model_t& model, reader& calib_reader, Index batches = 8) {
+    const std::vector<float> amax = calibrate(model, calib_reader, batches);
+    const std::vector<BaseLayer*>& layers = model.layers();
+    QuantizedModel qmodel;
+    // input and output layers have no work of their own
+    for (size_t i{ 1 }; i + 1 < layers.size(); i++) {
+        std::unique_ptr<QuantizedOp> op = quantize_layer(layers[i], amax[i]);
+        if (op) {
+            qmodel.add(std::move(op));
+        }
+    }
+    return qmodel;
+}
+
+// -- Float vs int8 comparison on a validation reader
+struct Report
+{
+    float float_accuracy;
+    float int8_accuracy;
+    size_t float_bytes;
+    size_t int8_bytes;
+    double float_ms;
+    double int8_ms;
+};
+
+std::ostream& operator<<(std::ostream& os, const Report& report);
+
+template<class model_t, class reader>
+Report compare(model_t& model, QuantizedModel& qmodel, reader& val_reader) {
+    Report report{};
+    Timer timer;
+    timer.start();
+    report.float_accuracy = model.accuracy(val_reader);
+    timer.stop();
+    report.float_ms = timer.elapsedMilliseconds();
+    timer.start();
+    report.int8_accuracy = qmodel.accuracy(val_reader, model.device());
+    timer.stop();
+    report.int8_ms = timer.elapsedMilliseconds();
+    report.float_bytes = model.param_buffer().size() * sizeof(float);
+    report.int8_bytes = qmodel.bytes();
+    return report;
+}
+
+}
+
+#endif
@@ -2,12 +2,25 @@
 #define SEQUENTIAL_H
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <memory>
+#include <future>
+#include <string>
+#include <stdexcept>
 #include <initializer_list>
 #include "typedefs.h"
 #include "batchPNGReader.h"
 #include "layers.h"
 #include "costs.h"
 #include "timer.h"
+#include "metrics.h"
+#include "optimizers.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "memory_report.h"
+#include "execution_context.h"
 
 template<size_t num_dims_in, size_t num_dims_out>
 class Sequential2
@@ -22,6 +35,178 @@ class Sequential2
     std::array<Index, num_dims_out> _out_shape;
     ThreadPool* _pool;
     Eigen::ThreadPoolDevice* _device;
+    // every layer's parameters and gradients are views into these,
+    // _param_data points to _params or to a mapped checkpoint
+    AlignedBuffer _params;
+    AlignedBuffer _grads;
+    float* _param_data{ nullptr };
+    std::unique_ptr<ckpt::MappedCheckpoint> _mapped;
+    // periodic checkpoints written while training
+    std::string _checkpoint_path;
+    int _checkpoint_every{ 0 };
+    std::future<void> _pending_checkpoint;
+    bool _sparse_input{ false };
+    // the input layer only wraps the batch, temporaries passed to
+    // fwdProp are kept here until the next one for bkwProp to read
+    in_batch_t _owned_input;
+    // layers after the input that do work in fwdProp/bkwProp, in order
+    std::vector<BaseLayer*> _compute;
+    std::vector<std::string> _compute_names;
+    Profiler _profiler;
+    // allocations made by the steps of the last training epoch
+    mem::AllocationCounts _epoch_allocations;
+    Index _epoch_steps{ 0 };
+    // micro-batches whose gradients are summed before an optimizer step
+    Index _micro_batches{ 1 };
+    // activation checkpointing: which of _compute keep their buffers 
+    // through fwdProp (empty when off) and which hold them right now
+    std::vector<bool> _kept;
+    std::vector<bool> _live;
+    Index _batch_size{ 0 };
+
+    bool released(size_t i) const {
+        return !_kept.empty() && !_kept[i];
+    }
+    void release(size_t i){
+        _compute[i]->release();
+        _live[i] = false;
+    }
+    // Recomputes the segment from the last kept layer before i up to i
+    void restore(size_t i){
+        if(_live[i]){
+            return;
+        }
+        size_t first{ i };
+        while(first > 0 && !_live[first - 1]){
+            first--;
+        }
+        for(size_t k{first}; k <= i; k++){
+            _compute[k]->init(_batch_size);
+            profiled(k, false, [&](){ _compute[k]->fwd(_device); });
+            _live[k] = true;
+        }
+    }
+
+    // layers that are views of their neighbours' buffers (reshapes, 
+    // folded layers) are left out of the passes
+    void link_compute(){
+        _compute.clear();
+        _compute_names.clear();
+        for(size_t i{1}; i < num_layers; i++){
+            if(!_layers[i]->is_view()){
+                _compute.push_back(_layers[i]);
+                _compute_names.push_back(std::to_string(i) + " " + _layers[i]->which());
+            }
+        }
+    }
+
+    void count_allocations(const mem::AllocationCounts& start, Index steps){
+        const mem::AllocationCounts end = mem::allocation_counts();
+        _epoch_allocations = {end.eigen - start.eigen, end.heap - start.heap,
+            end.heap_bytes - start.heap_bytes};
+        _epoch_steps = steps;
+    }
+
+    // The first micro-batch of a step overwrites the gradients, the next
+    // ones add to them
+    void accumulate_grads(bool accumulate){
+        for(BaseLayer* layer : _compute){
+            layer->_accumulate = accumulate;
+        }
+    }
+
+    // After the backward pass of every micro-batch, steps once all of
+    // them (or the last ones of an epoch, with flush) are summed
+    void micro_step(optim::Optimizer& optimizer, Index batch, Index& pending, 
+        bool flush = false){
+        pending += !flush;
+        if(pending == 0 || (pending < _micro_batches && !flush)){
+            accumulate_grads(pending > 0);
+            return;
+        }
+        step(optimizer, 1.0f / static_cast<float>(batch * pending));
+        pending = 0;
+        accumulate_grads(false);
+    }
+
+    template<typename F>
+    void profiled(size_t i, bool backward, F&& f){
+        if(!_profiler.enabled()){
+            f();
+            return;
+        }
+        const LayerWork work = _compute[i]->work();
+        _profiler.record(_compute_names[i], backward ? "bwd" : "fwd",
+            backward ? work.bwd_flops : work.fwd_flops,
+            backward ? work.bwd_bytes : work.fwd_bytes, f);
+    }
+
+    void step(optim::Optimizer& optimizer, float scale){
+        if(!_profiler.enabled()){
+            optimizer.step(scale, _device);
+            return;
+        }
+        _profiler.record("Optimizer", "update", optimizer.step_flops(),
+            optimizer.step_bytes(), [&](){ optimizer.step(scale, _device); });
+    }
+
+    // Layers between activation checkpoints are freed as soon as the next
+    // one has read them
+    void fwdLayer(size_t i){
+        if(!_kept.empty() && !_live[i]){
+            _compute[i]->init(_batch_size);
+            _live[i] = true;
+        }
+        profiled(i, false, [&](){ _compute[i]->fwd(_device); });
+        if(i > 0 && released(i - 1)){
+            release(i - 1);
+        }
+    }
+
+    template<class iterator>
+    void fwdBatch(iterator& it){
+        if constexpr (has_sparse_data<iterator>::value){
+            if(_sparse_input){
+                fwdProp(it.sparse_data());
+                return;
+            }
+        }
+        fwdProp(it.data());
+    }
+
+    void bindParams(float* params){
+        _param_data = params;
+        Index offset{0};
+        for(size_t i{0}; i < num_layers; i++){
+            _layers[i]->bindParams(params + offset, _grads.data() + offset);
+            offset += _layers[i]->num_params();
+        }
+    }
+
+    std::vector<ckpt::LayerRecord> layer_records(){
+        std::vector<ckpt::LayerRecord> records;
+        for(size_t i{0}; i < num_layers; i++){
+            records.push_back({_layers[i]->which(), 
+                _layers[i]->out_shape().dims(), _layers[i]->num_params()});
+        }
+        return records;
+    }
+
+    void checkpoint(int epoch, optim::Optimizer& optimizer){
+        if(_checkpoint_every <= 0 || (epoch + 1) % _checkpoint_every != 0){
+            return;
+        }
+        if(_pending_checkpoint.valid()){
+            _pending_checkpoint.get();
+        }
+        _pending_checkpoint = save_async(_checkpoint_path, &optimizer);
+    }
+    RunningMetrics _train_metrics;
+
+    template<class label_t>
+    auto output_map(label_t& labels) {
+        return _layers.back()->get_act().get(labels.dimensions());
+    }
 public:
     Sequential2(std::initializer_list<BaseLayer*> layers, std::array<Index, num_dims_in> in_shape, 
         std::array<Index, num_dims_out> out_shape, CostFun* cost = new DummyCost<num_dims_out>())
@@ -54,123 +239,296 @@ public:
             _layers[i-1]->_next = next_layer;
             next_layer = _layers[i-1];
         }
+
+        link_compute();
+
+        // allocate all parameters at once and initialize them
+        Index total_params{0};
+        for(size_t i{0}; i < num_layers; i++){
+            total_params += _layers[i]->num_params();
+        }
+        _params = AlignedBuffer(total_params);
+        _grads = AlignedBuffer(total_params);
+        bindParams(_params.data());
+        for(size_t i{0}; i < num_layers; i++){
+            _layers[i]->resetParams();
+        }
      }
     void init(size_t batch_size){
+        _batch_size = batch_size;
+        _live.assign(_compute.size(), true);
         for(size_t i{0}; i < num_layers; i++){
             _layers[i]->init(batch_size);
         }
+        for(size_t i{0}; i < _compute.size(); i++){
+            if(released(i)){
+                release(i);
+            }
+        }
     }
+    // With activation checkpointing a layer's buffers are recomputed before
+    // its backward pass, which also reads the previous activation, and 
+    // freed once the layer below has consumed its gradient
     void bkwProp(out_batch_t& output){
-        BaseLayer* layer = _layers.back();
-        layer->bwd(TensorWrapper(output), _device);
-        //layer->bwd(TensorWrapper(
-        //    _cost->grad((layer->get_act()).get(output.dimensions()), output)
-        //    ),
-        //    _device
-        //);
-        layer = layer->prev();
-
-        while(layer){
-            layer->bwd(_device);
-            layer = layer->prev();
+        profiled(_compute.size() - 1, true, [&](){
+            _compute.back()->bwd(TensorWrapper(output), _device);
+        });
+        for(size_t i{_compute.size() - 1}; i > 0; i--){
+            if(!_kept.empty()){
+                restore(i - 1);
+                if(i > 1){
+                    restore(i - 2);
+                }
+            }
+            profiled(i - 1, true, [&](){
+                _compute[i - 1]->bwd(_device);
+                // profiled layers finish all their work in their own timing
+                if(_profiler.enabled()){
+                    _compute[i - 1]->sync();
+                }
+            });
+            // the parameter gradients of layer i ran alongside the bwd above
+            _compute[i]->sync();
+            if(released(i)){
+                release(i);
+            }
+        }
+        _compute.front()->sync();
+    }
+    // Sparse batches go straight to the first layer, the input layer 
+    // would only make them dense
+    void fwdProp(const SparseBatch& input){
+        profiled(0, false, [&](){ _compute.front()->fwdSparse(input, _device); });
+        for(size_t i{1}; i < _compute.size(); i++){
+            fwdLayer(i);
         }
     }
+    // Readers that can produce sparse batches feed them to fwdProp
+    void sparse_input(bool sparse){
+        _sparse_input = sparse;
+    }
     void fwdProp(in_batch_t& input){
-        BaseLayer* layer = _layers.front();
-        layer->fwd(TensorWrapper(input), _device);
-        layer = layer->next();
-        while(layer){
-            layer->fwd(_device);
-            layer = layer->next();
+        _layers.front()->fwd(TensorWrapper(input), _device);
+        for(size_t i{0}; i < _compute.size(); i++){
+            fwdLayer(i);
         }
     }
+    // Flat views of all the parameters and gradients of the model
+    TensorMap<Tensor<float, 1>> param_buffer(){
+        return TensorMap<Tensor<float, 1>>(_param_data, _grads.size());
+    }
+    TensorMap<Tensor<float, 1>> grad_buffer(){
+        return TensorMap<Tensor<float, 1>>(_grads.data(), _grads.size());
+    }
+    void zero_grad(){
+        grad_buffer().device(*_device) = grad_buffer().constant(0.0f);
+    }
+
+    // -- Checkpoints
+    void save(const std::string& path, const optim::Optimizer* optimizer = nullptr){
+        const Tensor<float, 1> no_state;
+        const Tensor<float, 1>& state = optimizer ? optimizer->state() : no_state;
+        ckpt::write(path, layer_records(), _param_data, _grads.size(),
+            state.data(), state.size(), optimizer ? optimizer->steps() : 0);
+    }
+
+    // Parameters and optimizer state are copied before returning, the 
+    // file is written in the background
+    std::future<void> save_async(const std::string& path, 
+        const optim::Optimizer* optimizer = nullptr){
+        std::vector<float> params(_param_data, _param_data + _grads.size());
+        std::vector<float> state;
+        Index steps{0};
+        if(optimizer){
+            state.assign(optimizer->state().data(), 
+                optimizer->state().data() + optimizer->state().size());
+            steps = optimizer->steps();
+        }
+        return std::async(std::launch::async, 
+            [path, records = layer_records(), params = std::move(params), 
+            state = std::move(state), steps](){
+                ckpt::write(path, records, params.data(), params.size(),
+                    state.data(), state.size(), steps);
+            });
+    }
+
+    // Loads a checkpoint written by a model with the same layers. With 
+    // in_place the layers use the mapped file directly (copy-on-write),
+    // so nothing is copied until a parameter is updated
+    void load(const std::string& path, optim::Optimizer* optimizer = nullptr,
+        bool in_place = false){
+        auto mapped = std::make_unique<ckpt::MappedCheckpoint>(path);
+        if(mapped->layers() != layer_records()){
+            throw std::runtime_error("Checkpoint " + path + 
+                " does not match the model layers");
+        }
+        // rebind first, the optimizer keeps views of the parameters
+        if(in_place){
+            bindParams(mapped->params());
+            _params = AlignedBuffer();
+        }else{
+            if(_params.size() != _grads.size()){
+                _params = AlignedBuffer(_grads.size());
+                bindParams(_params.data());
+            }
+            std::copy_n(mapped->params(), _params.size(), _params.data());
+        }
+        if(optimizer){
+            optimizer->init(parameters());
+            optimizer->restore(mapped->state(), mapped->state_size(), mapped->steps());
+        }
+        if(in_place){
+            _mapped = std::move(mapped);
+        }else{
+            _mapped.reset();
+        }
+    }
+
+    // Writes a checkpoint every n epochs of train() without stalling it
+    void checkpoint_every(const std::string& path, int epochs){
+        _checkpoint_path = path;
+        _checkpoint_every = epochs;
+    }
+
+    std::vector<Parameter> parameters(){
+        std::vector<Parameter> params;
+        for(size_t i{0}; i < num_layers; i++){
+            std::vector<Parameter> layer_params = _layers[i]->parameters();
+            params.insert(params.end(), layer_params.begin(), layer_params.end());
+        }
+        return params;
+    }
     void bkwProp(out_batch_t&& output){bkwProp(output);}
-    void fwdProp(in_batch_t&& input){fwdProp(input);}
+    void fwdProp(in_batch_t&& input){
+        _owned_input = std::move(input);
+        fwdProp(_owned_input);
+    }
    
     template<class reader>
-    void SGD(reader& train_reader, int epochs, float lr,
-        float mu, reader& val_reader) {
+    void train(reader& train_reader, int epochs, optim::Optimizer& optimizer,
+        reader& val_reader) {
         typedef reader::out_data_t data_t;
         // check if read data type matches input data type
         static_assert(std::is_same<in_batch_t, data_t>::value);
 
         Timer timer;
+        optimizer.init(parameters());
         for (int k{ 0 }; k < epochs; k++) {
             init(train_reader.batch());
             train_reader.reset();
             timer.start();
             auto end = train_reader.end();
-            int ki = 0;
-            for (auto it = train_reader.begin(); it != end; it++) {
-                ki++;
-                fwdProp(it.data());
-                bkwProp(it.labels());
-                for (size_t i{ 0 }; i < num_layers; i++) {
-                    _layers[i]->update(lr, mu, train_reader.batch());
-                }
+            _train_metrics.reset();
+            const mem::AllocationCounts allocations = mem::allocation_counts();
+            Index steps{ 0 };
+            Index pending{ 0 };
+            training(true);
+            for (auto it = train_reader.begin(); it != end; it++, steps++) {
+                fwdBatch(it);
+                decltype(auto) labels = it.labels();
+                bkwProp(labels);
+                _train_metrics.update(output_map(labels), labels, 
+                    _cost->loss(), _device);
+                micro_step(optimizer, train_reader.batch(), pending);
             }
+            micro_step(optimizer, train_reader.batch(), pending, true);
+            training(false);
+            count_allocations(allocations, steps);
             timer.stop();
+            checkpoint(k, optimizer);
             std::cout << "Epoch " << k + 1 << "\n";
+            std::cout << "Loss: " << _train_metrics.loss();
+            std::cout << " Train accuracy: " << _train_metrics.accuracy() * 100 << " %\n";
             float cost_t = accuracy(val_reader);
             std::cout << "Accuracy: " << cost_t * 100 << " %" << "\n";
             std::cout << "Time: " << timer.elapsedMilliseconds() << "ms\n";
         }
+        if(_pending_checkpoint.valid()){
+            _pending_checkpoint.get();
+        }
     }
 
-    void SGD(in_batch_t& x, out_batch_t& y, int epochs, int batch_size, 
-        float lr, float mu, in_batch_t& val_x, out_batch_t& val_y){
+    void train(in_batch_t& x, out_batch_t& y, int epochs, int batch_size, 
+        optim::Optimizer& optimizer, in_batch_t& val_x, out_batch_t& val_y){
         Timer timer;
-        size_t train_size = x.dimension(num_dims_in);
+        optimizer.init(parameters());
+        const Index train_size = x.dimension(num_dims_in);
 
         // Prepare random indices 
         std::vector<int> indices(train_size);
-        std::vector<int> sub_indices(batch_size);
-        for(size_t i{0}; i < train_size; i++){indices.push_back(i);} 
+        std::iota(indices.begin(), indices.end(), 0);
+
+        // Batches are gathered into the same buffers at every step
+        auto x_shape = x.dimensions();
+        auto y_shape = y.dimensions();
+        x_shape[num_dims_in] = batch_size;
+        y_shape[num_dims_out] = batch_size;
+        in_batch_t x_batch(x_shape);
+        out_batch_t y_batch(y_shape);
 
         for(int k{0}; k < epochs; k++){
             init(batch_size);
             timer.start();
             std::shuffle(indices.begin(), indices.end(), gen);
             
-            for(size_t l{0}; l < train_size-batch_size; l+=batch_size){
-                std::copy_n(indices.begin()+l, batch_size, sub_indices.begin());
-                fwdProp(sliced(x, sub_indices, num_dims_in));
-                bkwProp(sliced(y, sub_indices, num_dims_out));
-                for(size_t i{0}; i < num_layers; i++){
-                    _layers[i]->update(lr, mu, batch_size);                
-                }
+            _train_metrics.reset();
+            const mem::AllocationCounts allocations = mem::allocation_counts();
+            Index steps{ 0 };
+            Index pending{ 0 };
+            training(true);
+            for(Index l{0}; l + batch_size <= train_size; l+=batch_size, steps++){
+                gather(x, indices.data() + l, x_batch, _device);
+                gather(y, indices.data() + l, y_batch, _device);
+                fwdProp(x_batch);
+                bkwProp(y_batch);
+                _train_metrics.update(output_map(y_batch), y_batch, 
+                    _cost->loss(), _device);
+                micro_step(optimizer, batch_size, pending);
             }
+            micro_step(optimizer, batch_size, pending, true);
+            training(false);
+            count_allocations(allocations, steps);
 
             float cost_t = accuracy(val_x, val_y);
             std::cout << "Epoch " << k << " :" << cost_t*100; 
             std::cout << " %" << "\n";
+            std::cout << "Loss: " << _train_metrics.loss();
+            std::cout << " Train accuracy: " << _train_metrics.accuracy() * 100 << " %\n";
             timer.stop();
             std::cout << "Time: " << timer.elapsedMilliseconds() << "ms\n";
+            checkpoint(k, optimizer);
+        }
+        if(_pending_checkpoint.valid()){
+            _pending_checkpoint.get();
         }
     }
     
+    // Plain SGD, mu is the L2 weight decay scaled by the batch size
+    template<class reader>
+    void SGD(reader& train_reader, int epochs, float lr,
+        float mu, reader& val_reader) {
+        optim::SGD optimizer(lr, mu / train_reader.batch());
+        train(train_reader, epochs, optimizer, val_reader);
+    }
+
+    void SGD(in_batch_t& x, out_batch_t& y, int epochs, int batch_size, 
+        float lr, float mu, in_batch_t& val_x, out_batch_t& val_y){
+        optim::SGD optimizer(lr, mu / batch_size);
+        train(x, y, epochs, batch_size, optimizer, val_x, val_y);
+    }
+
     template<class reader>
     float accuracy(reader& val_reader) {
-        typedef reader::out_label_t label_t;
         const Eigen::Index test_size{val_reader.size()};
         const Eigen::Index batch_size{val_reader.batch()};
         val_reader.reset();
-        int sum = 0;
-		label_t labels;
-        Tensor<Index, 0> y;
-        Tensor<Index, 0> y_pred;
+        init(batch_size);
+        Index sum = 0;
         auto end = val_reader.end();
         for(auto it = val_reader.begin(); it!=end;it++){
-            init(batch_size);
-            fwdProp(it.data());
-            labels = it.labels();
-            Tensor<float, 2> pred = _layers.back()
-                ->get_act().get(labels.dimensions());
-            for (Eigen::Index i{ 0 }; i < batch_size; i++) {
-                y_pred = pred.chip(i, 1).argmax();
-                y = labels.chip(i, 1).argmax();
-                sum += (static_cast<int>(y(0)) == y_pred(0));
-            }
+            fwdBatch(it);
+            decltype(auto) labels = it.labels();
+            sum += count_correct(output_map(labels), labels, _device);
         }
         return static_cast<float>(sum) / static_cast<float>(test_size);
     }
@@ -179,24 +537,169 @@ public:
         Eigen::Index test_size{x.dimension(num_dims_in)};
         init(test_size);
         fwdProp(x);
-        std::array<Index, num_dims_out + 1> batch_shape;
-        for(size_t i{0}; i < num_dims_out; i++){
-            batch_shape[i] = _out_shape[i];
+        Index sum = count_correct(output_map(y), y, _device);
+        return static_cast<float>(sum) / static_cast<float>(test_size);
+    }
+
+    // Per-layer timings of fwdProp/bkwProp and optimizer steps, off 
+    // until profiler().enable(true)
+    Profiler& profiler(){
+        return _profiler;
+    }
+
+    const std::vector<BaseLayer*>& layers() const {
+        return _layers;
+    }
+
+    ThreadPoolDevice* device() const {
+        return _device;
+    }
+
+    const std::array<Index, num_dims_in>& in_shape() const {
+        return _in_shape;
+    }
+
+    const std::array<Index, num_dims_out>& out_shape() const {
+        return _out_shape;
+    }
+
+    // State for forward passes on another thread, reading this model's
+    // weights. See ExecutionContext
+    ExecutionContext<num_dims_in, num_dims_out> context(int threads = 1){
+        return ExecutionContext<num_dims_in, num_dims_out>(_layers, _out_shape, threads);
+    }
+
+    // Batch statistics in fwdProp instead of running averages, train 
+    // turns it on for its steps and off for the evaluations
+    void training(bool on){
+        for(BaseLayer* layer : _layers){
+            layer->_training = on;
+        }
+    }
+    // Merges the batch norm layers into the fully connected layers after
+    // them for inference, returns how many were folded. Training after 
+    // folding leaves the folded layers out
+    size_t fold_batch_norm(){
+        size_t folded{ 0 };
+        for(BaseLayer* layer : _layers){
+            folded += layer->fold();
+        }
+        link_compute();
+        _kept.clear();
+        if(_batch_size > 0){
+            init(_batch_size);
         }
-        batch_shape.back() = test_size;
-        Tensor<float, 2> pred = _layers.back()
-            ->get_act().get(batch_shape);
+        return folded;
+    }
 
-        Tensor<Eigen::Index, 0> y_pred;
-        int sum{0};
+    // -- Activation checkpointing
+    // Only the given layers (indices in layers()), the first and the last
+    // ones keep their activations through fwdProp. The layers in between 
+    // free theirs once read and bkwProp recomputes them one segment at a 
+    // time, trading another forward pass and per-step allocations for 
+    // memory. A view keeps the layer it shows. An empty list turns it off
+    void checkpoint_activations(const std::vector<size_t>& boundaries){
+        _kept.clear();
+        if(!boundaries.empty()){
+            _kept.assign(_compute.size(), false);
+            std::vector<size_t> shown(num_layers, _compute.size());
+            for(size_t l{1}, c{0}; l < num_layers; l++){
+                c += !_layers[l]->is_view();
+                shown[l] = c - 1;
+            }
+            for(size_t l : boundaries){
+                if(l >= num_layers){
+                    throw std::out_of_range("No layer " + std::to_string(l));
+                }
+                if(shown[l] < _compute.size()){
+                    _kept[shown[l]] = true;
+                }
+            }
+            // the output layer may show the activation before it
+            _kept.front() = true;
+            _kept.back() = true;
+            _kept[std::max<size_t>(_compute.size(), 2) - 2] = true;
+        }
+        if(_batch_size > 0){
+            init(_batch_size);
+        }
+    }
+    // sqrt(N) policy: every ceil(sqrt(N))-th of the N layers is kept, so
+    // about 2 sqrt(N) activations are held at once
+    void checkpoint_activations(){
+        const size_t n = _compute.size();
+        const size_t every = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(n))));
+        std::vector<size_t> boundaries;
+        for(size_t l{1}, c{0}; l < num_layers; l++){
+            if(!_layers[l]->is_view() && c++ % every == 0){
+                boundaries.push_back(l);
+            }
+        }
+        checkpoint_activations(boundaries);
+    }
 
-        for(Eigen::Index i{0}; i < test_size; i++){
-            y_pred = pred.chip(i, num_dims_out).argmax();
-            sum += (static_cast<int>(y(i)) == y_pred(0));
+    // Gradient accumulation: train sums the gradients of n consecutive
+    // batches and steps once, as with a batch n times larger, while the
+    // activations only take the memory of one batch
+    void accumulate(int n){
+        if(n < 1){
+            throw std::invalid_argument("Accumulation needs at least one batch");
         }
+        _micro_batches = n;
+    }
+    // Replaces the thread pool, fwdProp/bkwProp and the optimizer steps
+    // then run on n threads
+    void threads(int n){
+        delete _device;
+        delete _pool;
+        _pool = new ThreadPool(n);
+        _device = new ThreadPoolDevice(_pool, n);
+    }
 
-        return static_cast<float>(sum) / static_cast<float>(test_size);
+    // Bytes held by every layer for the current batch size by role, the
+    // optimizer state and the thread pool queues. Allocations per step
+    // are those of the last training epoch
+    mem::MemoryReport memory_report(const optim::Optimizer* optimizer = nullptr){
+        mem::MemoryReport report;
+        for(size_t i{0}; i < num_layers; i++){
+            const std::string owner = std::to_string(i) + " " + _layers[i]->which();
+            const LayerMemory m = _layers[i]->memory();
+            report.add(owner, mem::Role::Activation, m.activation);
+            report.add(owner, mem::Role::Gradient, m.gradient);
+            report.add(owner, mem::Role::Weights, m.weights);
+            report.add(owner, mem::Role::Scratch, m.scratch);
+        }
+        report.add("Input batch", mem::Role::Input, _owned_input.size() * sizeof(float));
+        if(optimizer != nullptr){
+            report.add("Optimizer", mem::Role::Optimizer, 
+                optimizer->state().size() * sizeof(float));
+        }
+        report.add("Thread pool", mem::Role::Scratch, 
+            _pool->NumThreads() * sizeof(ThreadPool::Queue));
+        if(_epoch_steps > 0){
+            report.eigen_allocations_per_step = 
+                static_cast<double>(_epoch_allocations.eigen) / _epoch_steps;
+            report.heap_allocations_per_step = 
+                static_cast<double>(_epoch_allocations.heap) / _epoch_steps;
+            report.heap_bytes_per_step = 
+                static_cast<double>(_epoch_allocations.heap_bytes) / _epoch_steps;
+        }
+        return report;
+    }
+
+    // Same, adding the batch buffers of a reader's iterator
+    template<class reader>
+    mem::MemoryReport memory_report(reader& batch_reader, const optim::Optimizer* optimizer){
+        mem::MemoryReport report = memory_report(optimizer);
+        report.add("Reader", mem::Role::Input, batch_reader.begin().bytes());
+        return report;
     }
+
+    // Running loss/accuracy of the last training epoch
+    const RunningMetrics& train_metrics() const {
+        return _train_metrics;
+    }
+
     float accuracy(in_batch_t&& x, out_batch_t&& y){
         return accuracy(x, y);
     }
@@ -210,6 +713,9 @@ public:
     }
 
     ~Sequential2() {
+        if(_pending_checkpoint.valid()){
+            _pending_checkpoint.wait();
+        }
         for (size_t i{ 0 }; i < num_layers; i++) {
             delete _layers[i];
         }
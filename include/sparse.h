@@ -0,0 +1,130 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <type_traits>
+#include <vector>
+#include "typedefs.h"
+
+// -- Batch of sparse samples in compressed rows: sample j owns the
+// entries offsets[j] to offsets[j + 1] of indices/values
+class SparseBatch
+{
+    Index _rows{ 0 };
+    std::vector<Index> _offsets{ 0 };
+    std::vector<int> _indices;
+    std::vector<float> _values;
+public:
+    SparseBatch() = default;
+    SparseBatch(Index rows): _rows{ rows } {}
+
+    // Empties the batch, keeping the allocated memory
+    void clear() {
+        _offsets.resize(1);
+        _indices.clear();
+        _values.clear();
+    }
+    void push(int index, float value) {
+        _indices.push_back(index);
+        _values.push_back(value);
+    }
+    void close_sample() {
+        _offsets.push_back(static_cast<Index>(_indices.size()));
+    }
+
+    // number of features of every sample
+    Index rows() const { return _rows; }
+    Index batch() const { return static_cast<Index>(_offsets.size()) - 1; }
+    Index nnz() const { return static_cast<Index>(_values.size()); }
+    const Index* offsets() const { return _offsets.data(); }
+    const int* indices() const { return _indices.data(); }
+    const float* values() const { return _values.data(); }
+    size_t bytes() const {
+        return _offsets.capacity() * sizeof(Index) + _indices.capacity() * sizeof(int)
+            + _values.capacity() * sizeof(float);
+    }
+
+    Tensor<float, 2> dense() const {
+        Tensor<float, 2> out(_rows, batch());
+        out.setZero();
+        for (Index j{ 0 }; j < batch(); j++) {
+            for (Index k{ _offsets[j] }; k < _offsets[j + 1]; k++) {
+                out(_indices[k], j) = _values[k];
+            }
+        }
+        return out;
+    }
+};
+
+// Iterators that can produce SparseBatch data
+template<typename T, typename = void>
+struct has_sparse_data: std::false_type {};
+template<typename T>
+struct has_sparse_data<T, std::void_t<decltype(std::declval<T&>().sparse_data())>>
+    : std::true_type {};
+
+namespace Eigen
+{
+
+// -- Sparse input times dense weights: out[:, j] = biases + the weight
+// columns of the non-zero features of sample j scaled by their values
+template<typename ArgType1, typename ArgType2, typename ArgType3>
+void sparse_fc(const SparseBatch& input, const ArgType1& weights,
+    const ArgType2& biases, ArgType3& output, ThreadPoolDevice* device) {
+    const Index rows = weights.dimension(0);
+    const float* w = weights.data();
+    const float* b = biases.data();
+    float* out = output.data();
+    const Index* offsets = input.offsets();
+    const int* indices = input.indices();
+    const float* values = input.values();
+    const double nnz = static_cast<double>(input.nnz()) / std::max<Index>(1, input.batch());
+
+    device->parallelFor(input.batch(),
+        TensorOpCost((nnz + 1) * rows * sizeof(float), rows * sizeof(float), 2 * nnz * rows),
+        [=](Index first, Index last) {
+            for (Index j{ first }; j < last; j++) {
+                Map<ArrayXf> o(out + j * rows, rows);
+                o = Map<const ArrayXf>(b, rows);
+                for (Index k{ offsets[j] }; k < offsets[j + 1]; k++) {
+                    o += values[k] * Map<const ArrayXf>(w + indices[k] * rows, rows);
+                }
+            }
+        });
+}
+
+// -- Weight gradient delta * input^T, only the columns of features present
+// in the batch are accumulated. Threads own disjoint blocks of output rows
+// so samples sharing a feature never write to the same element. With
+// accumulate the gradient is added to nabla_w instead of replacing it
+template<typename ArgType1, typename ArgType2>
+void sparse_weight_grad(const ArgType1& delta, const SparseBatch& input,
+    ArgType2& nabla_w, ThreadPoolDevice* device, bool accumulate = false) {
+    const Index rows = delta.dimension(0);
+    const Index cols = nabla_w.dimension(1);
+    const float* d = delta.data();
+    float* nw = nabla_w.data();
+    const Index* offsets = input.offsets();
+    const int* indices = input.indices();
+    const float* values = input.values();
+    const Index batch = input.batch();
+
+    device->parallelFor(rows,
+        TensorOpCost(static_cast<double>(input.nnz() + batch) * sizeof(float),
+            static_cast<double>(cols) * sizeof(float), 2.0 * input.nnz()),
+        [=](Index first, Index last) {
+            const Index n = last - first;
+            for (Index c{ 0 }; !accumulate && c < cols; c++) {
+                Map<ArrayXf>(nw + c * rows + first, n).setZero();
+            }
+            for (Index j{ 0 }; j < batch; j++) {
+                const Map<const ArrayXf> dj(d + j * rows + first, n);
+                for (Index k{ offsets[j] }; k < offsets[j + 1]; k++) {
+                    Map<ArrayXf>(nw + indices[k] * rows + first, n) += values[k] * dj;
+                }
+            }
+        });
+}
+
+}
+
+#endif
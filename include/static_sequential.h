@@ -0,0 +1,245 @@
+#ifndef STATIC_SEQUENTIAL_H
+#define STATIC_SEQUENTIAL_H
+
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "typedefs.h"
+#include "layers.h"
+
+// -- Layers with their shapes in the type
+// Every layer maps an expression of its input to an expression of its
+// output. Element-wise layers only wrap the expression they get, so they
+// are fused into the assignment that evaluates the previous product.
+
+template<int In, int Out>
+class StaticDense
+{
+public:
+    static constexpr bool elementwise = false;
+    static constexpr int in_size = In;
+    static constexpr int out_size = Out;
+    Eigen::Matrix<float, Out, In> weights;
+    Eigen::Matrix<float, Out, 1> biases;
+
+    template<typename ArgType>
+    auto operator()(const ArgType& x) const {
+        return ((weights * x).colwise() + biases).array();
+    }
+};
+
+template<typename Functor>
+class StaticActivation
+{
+public:
+    static constexpr bool elementwise = true;
+
+    template<typename ArgType>
+    auto operator()(const ArgType& x) const {
+        return x.array().unaryExpr(Functor());
+    }
+};
+
+using StaticSigmoid = StaticActivation<Eigen::internal::scalar_logistic_op<float>>;
+using StaticTanh = StaticActivation<Eigen::internal::scalar_tanh_op<float>>;
+
+// Normalizes every column, so its input is evaluated first
+class StaticSoftMax
+{
+public:
+    static constexpr bool elementwise = false;
+
+    template<typename ArgType>
+    auto operator()(const ArgType& x) const {
+        typedef Eigen::Array<float, ArgType::RowsAtCompileTime,
+            ArgType::ColsAtCompileTime> array_t;
+        array_t e = (x.array().rowwise() - x.array().colwise().maxCoeff()).exp();
+        e.rowwise() /= e.colwise().sum();
+        return e;
+    }
+};
+
+namespace static_internal
+{
+// Rows of the output of a chain of static layers fed Rows rows,
+// element-wise layers keep the number of rows
+template<int Rows, typename... Layers>
+struct out_size;
+
+template<int Rows>
+struct out_size<Rows> { static constexpr int value = Rows; };
+
+template<int Rows, typename Layer, typename... Rest>
+struct out_size<Rows, Layer, Rest...>
+{
+    template<typename L, typename = void>
+    struct next { static constexpr int value = Rows; };
+    template<typename L>
+    struct next<L, std::void_t<decltype(L::out_size)>> {
+        static_assert(L::in_size == Rows, "Layer input does not match the previous output");
+        static constexpr int value = L::out_size;
+    };
+    static constexpr int value = out_size<next<Layer>::value, Rest...>::value;
+};
+
+template<typename Layer>
+struct is_dense : std::false_type {};
+template<int In, int Out>
+struct is_dense<StaticDense<In, Out>> : std::true_type {};
+
+// Fully connected layer of a Sequential2 a StaticDense followed by this
+// activation is loaded from
+template<typename Activation>
+struct dynamic_layer { typedef void type; };
+template<>
+struct dynamic_layer<StaticSigmoid> { typedef SigmoidLayer type; };
+template<>
+struct dynamic_layer<StaticTanh> { typedef TanhLayer type; };
+template<>
+struct dynamic_layer<StaticSoftMax> { typedef SoftMaxLayer type; };
+
+// Tuple with the (fixed-size) input buffer of every layer
+template<int Rows, int Batch, typename... Layers>
+struct buffers { typedef std::tuple<> type; };
+
+template<int Rows, int Batch, typename Layer, typename... Rest>
+struct buffers<Rows, Batch, Layer, Rest...>
+{
+    typedef decltype(std::tuple_cat(
+        std::declval<std::tuple<Eigen::Matrix<float, Rows, Batch>>>(),
+        std::declval<typename buffers<out_size<Rows, Layer>::value, 
+            Batch, Rest...>::type>())) type;
+};
+}
+
+// -- Network fixed at compile time
+// Shapes are template arguments, so inter-layer buffers are fixed-size
+// matrices, calls are resolved statically and chains of element-wise
+// layers are evaluated in the same pass as the product before them.
+// Meant for small models and small batches (e.g. single-sample inference).
+template<int In, int Batch, typename... Layers>
+class StaticSequential
+{
+public:
+    static constexpr int in_size = In;
+    static constexpr int out_size = static_internal::out_size<In, Layers...>::value;
+    typedef Eigen::Matrix<float, In, Batch> in_t;
+    typedef Eigen::Matrix<float, out_size, Batch> out_t;
+private:
+    std::tuple<Layers...> _layers;
+    // only the inputs of layers that are not element-wise are written
+    typename static_internal::buffers<In, Batch, Layers...>::type _buffers;
+    out_t _out;
+
+    template<size_t I, int Rows, typename ArgType>
+    auto run(const ArgType& x) {
+        if constexpr (I == sizeof...(Layers)) {
+            return x;
+        }
+        else {
+            typedef std::tuple_element_t<I, std::tuple<Layers...>> layer_t;
+            constexpr int out_rows = static_internal::out_size<Rows, layer_t>::value;
+            const layer_t& layer = std::get<I>(_layers);
+            if constexpr (layer_t::elementwise) {
+                return run<I + 1, out_rows>(layer(x));
+            }
+            else {
+                // products read their input more than once, so it is 
+                // evaluated into the layer's buffer first
+                auto& buffer = std::get<I>(_buffers);
+                buffer = x.matrix();
+                return run<I + 1, out_rows>(layer(buffer));
+            }
+        }
+    }
+
+    static std::string describe(const std::vector<BaseLayer*>& layers, size_t i) {
+        return "Layer " + std::to_string(i) + " (" + layers[i]->which() + ")";
+    }
+
+    // Next layer with parameters, which has to be a fully connected one
+    // applying the activation that follows the StaticDense
+    template<typename Activation, int LIn, int LOut>
+    static void load_dense(StaticDense<LIn, LOut>& dense,
+        const std::vector<BaseLayer*>& layers, size_t& next) {
+        typedef typename static_internal::dynamic_layer<Activation>::type dynamic_t;
+        static_assert(!std::is_void_v<dynamic_t>, 
+            "StaticDense must be followed by StaticSigmoid, StaticTanh or StaticSoftMax to be loaded");
+        for (; next < layers.size(); next++) {
+            std::vector<Parameter> params = layers[next]->parameters();
+            if (params.empty()) {
+                continue;
+            }
+            FCLayer* fc = dynamic_cast<FCLayer*>(layers[next]);
+            if (fc == nullptr) {
+                throw std::runtime_error(describe(layers, next) + 
+                    " has no StaticSequential counterpart");
+            }
+            if (dynamic_cast<dynamic_t*>(fc) == nullptr) {
+                throw std::runtime_error(describe(layers, next) + 
+                    " does not apply the activation that follows its StaticDense");
+            }
+            if (params[0].value._size != static_cast<size_t>(LIn * LOut) ||
+                params[1].value._size != static_cast<size_t>(LOut)) {
+                throw std::runtime_error(describe(layers, next) +
+                    " does not match the StaticDense shape");
+            }
+            dense.weights = Eigen::Map<const Eigen::Matrix<float, LOut, LIn>>(
+                params[0].value.data);
+            dense.biases = Eigen::Map<const Eigen::Matrix<float, LOut, 1>>(
+                params[1].value.data);
+            next++;
+            return;
+        }
+        throw std::runtime_error("Model has fewer fully connected layers than the StaticSequential");
+    }
+
+    template<size_t I>
+    void load_from(const std::vector<BaseLayer*>& layers, size_t& next) {
+        if constexpr (I < sizeof...(Layers)) {
+            typedef std::tuple_element_t<I, std::tuple<Layers...>> layer_t;
+            if constexpr (static_internal::is_dense<layer_t>::value) {
+                static_assert(I + 1 < sizeof...(Layers), 
+                    "StaticDense must be followed by its activation to be loaded");
+                typedef std::tuple_element_t<I + 1, std::tuple<Layers...>> activation_t;
+                load_dense<activation_t>(std::get<I>(_layers), layers, next);
+            }
+            load_from<I + 1>(layers, next);
+        }
+    }
+public:
+    template<size_t I>
+    auto& layer() { return std::get<I>(_layers); }
+
+    // x holds Batch samples of In values
+    const out_t& forward(const float* x) {
+        _out = run<0, In>(Eigen::Map<const in_t>(x).array()).matrix();
+        return _out;
+    }
+
+    const out_t& forward(const in_t& x) {
+        return forward(x.data());
+    }
+
+    // Copies, in order, the weights of the fully connected layers of a 
+    // trained model (e.g. Sequential2::layers()) into the StaticDense layers.
+    // Throws when a layer with parameters is not a fully connected one with
+    // the activation of the static network (batch norm has to be folded
+    // first) or when the model has more of them
+    void load(const std::vector<BaseLayer*>& layers) {
+        size_t next{ 0 };
+        load_from<0>(layers, next);
+        for (; next < layers.size(); next++) {
+            if (!layers[next]->parameters().empty()) {
+                throw std::runtime_error(describe(layers, next) + 
+                    " has no counterpart in the StaticSequential");
+            }
+        }
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
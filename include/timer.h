@@ -11,30 +11,30 @@ class Timer
 public:
     void start()
     {
-        m_StartTime = std::chrono::system_clock::now();
+        m_StartTime = std::chrono::steady_clock::now();
         m_bRunning = true;
     }
     
     void stop()
     {
-        m_EndTime = std::chrono::system_clock::now();
+        m_EndTime = std::chrono::steady_clock::now();
         m_bRunning = false;
     }
     
     double elapsedMilliseconds()
     {
-        std::chrono::time_point<std::chrono::system_clock> endTime;
+        std::chrono::time_point<std::chrono::steady_clock> endTime;
         
         if(m_bRunning)
         {
-            endTime = std::chrono::system_clock::now();
+            endTime = std::chrono::steady_clock::now();
         }
         else
         {
             endTime = m_EndTime;
         }
         
-        return std::chrono::duration_cast<std::chrono::milliseconds>(endTime - m_StartTime).count();
+        return std::chrono::duration<double, std::milli>(endTime - m_StartTime).count();
     }
     
     double elapsedSeconds()
@@ -43,8 +43,8 @@ public:
     }
 
 private:
-    std::chrono::time_point<std::chrono::system_clock> m_StartTime;
-    std::chrono::time_point<std::chrono::system_clock> m_EndTime;
+    std::chrono::time_point<std::chrono::steady_clock> m_StartTime;
+    std::chrono::time_point<std::chrono::steady_clock> m_EndTime;
     bool                                               m_bRunning = false;
 };
 
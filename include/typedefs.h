@@ -3,8 +3,12 @@
 
 #define EIGEN_USE_THREADS
 
+// sets up allocation counting (NNN_TRACK_ALLOCATIONS) before Eigen
+#include "allocations.h"
+
 #include <unsupported/Eigen/CXX11/Tensor>
 #include <unsupported/Eigen/CXX11/ThreadPool>
+#include <type_traits>
 
 using Eigen::Index;
 using Eigen::Tensor;
@@ -12,9 +16,32 @@ using Eigen::TensorMap;
 using Eigen::TensorRef; 
 using Eigen::ThreadPoolDevice;
 using Eigen::ThreadPool;
+using Eigen::Barrier;
 
 using byte = unsigned char;
 
+// Storage scalar of the activations and gradients of the layers working on
+// convolutional layouts (convolution, pooling, ActivationLayer<Op, 4>,
+// BatchNormLayer<4>) and of the weighted inputs fully connected layers
+// stash for the backward pass, bfloat16 with NNN_MIXED_PRECISION. It is
+// widened to float inside the kernels that read it, weights, fully
+// connected activations and all arithmetic stay in float
+#ifdef NNN_MIXED_PRECISION
+using storage_t = Eigen::bfloat16;
+#else
+using storage_t = float;
+#endif
+
+// expr as a Scalar expression, itself when it already is one
+template<typename Scalar, typename Expr>
+decltype(auto) cast_to(const Expr& expr){
+    if constexpr (std::is_same_v<typename Eigen::internal::traits<Expr>::Scalar, Scalar>){
+        return expr;
+    }else{
+        return expr.template cast<Scalar>();
+    }
+}
+
 enum ConvolTypes{
     valid,
     full,
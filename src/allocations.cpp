@@ -0,0 +1,62 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "typedefs.h"
+
+namespace
+{
+std::atomic<size_t> eigen_count{ 0 };
+std::atomic<size_t> heap_count{ 0 };
+std::atomic<size_t> heap_bytes{ 0 };
+
+#ifdef NNN_TRACK_ALLOCATIONS
+// from here on every Eigen allocation goes through count_eigen_allocation
+[[maybe_unused]] const bool malloc_disallowed = (Eigen::internal::set_is_malloc_allowed(false), true);
+#endif
+}
+
+namespace mem
+{
+
+AllocationCounts allocation_counts() {
+    return { eigen_count.load(std::memory_order_relaxed),
+        heap_count.load(std::memory_order_relaxed),
+        heap_bytes.load(std::memory_order_relaxed) };
+}
+
+void count_eigen_allocation() {
+    eigen_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+}
+
+#ifdef NNN_TRACK_ALLOCATIONS
+void* operator new(std::size_t size) {
+    heap_count.fetch_add(1, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
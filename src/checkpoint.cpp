@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include "checkpoint.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+namespace ip = boost::interprocess;
+
+namespace ckpt
+{
+
+static uint64_t aligned_offset(uint64_t offset){
+    return (offset + 63) / 64 * 64;
+}
+
+static void pad(std::ofstream& fout, uint64_t offset){
+    static const char zeros[64] = {};
+    const uint64_t target = aligned_offset(offset);
+    fout.write(zeros, static_cast<std::streamsize>(target - offset));
+}
+
+void write(const std::string& path, const std::vector<LayerRecord>& layers,
+    const float* params, Index num_params, 
+    const float* state, Index state_size, Index steps){
+    Header header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.num_layers = layers.size();
+    header.num_params = num_params;
+    header.state_size = state_size;
+    header.steps = steps;
+
+    uint64_t offset = sizeof(Header);
+    for(const LayerRecord& layer : layers){
+        offset += sizeof(uint32_t) + layer.descriptor.size() + sizeof(uint32_t)
+            + layer.out_shape.size() * sizeof(int64_t) + sizeof(int64_t);
+    }
+    header.params_offset = aligned_offset(offset);
+    header.state_offset = aligned_offset(header.params_offset 
+        + num_params * sizeof(float));
+
+    // written next to the target and renamed, so a crash never leaves
+    // a truncated checkpoint behind
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream fout(tmp_path, std::ios::binary | std::ios::trunc);
+    if(!fout){
+        throw std::runtime_error("Cannot open checkpoint " + tmp_path);
+    }
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    for(const LayerRecord& layer : layers){
+        const uint32_t length = static_cast<uint32_t>(layer.descriptor.size());
+        const uint32_t rank = static_cast<uint32_t>(layer.out_shape.size());
+        const int64_t n = layer.num_params;
+        fout.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        fout.write(layer.descriptor.data(), length);
+        fout.write(reinterpret_cast<const char*>(&rank), sizeof(rank));
+        for(Index d : layer.out_shape){
+            const int64_t dim = d;
+            fout.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+        }
+        fout.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+    pad(fout, offset);
+    fout.write(reinterpret_cast<const char*>(params), num_params * sizeof(float));
+    pad(fout, header.params_offset + num_params * sizeof(float));
+    fout.write(reinterpret_cast<const char*>(state), state_size * sizeof(float));
+    fout.close();
+    if(!fout){
+        throw std::runtime_error("Error writing checkpoint " + tmp_path);
+    }
+    // rename replaces the target atomically on POSIX, Windows needs
+    // MoveFileEx to replace an existing file
+#ifdef _WIN32
+    const bool moved = MoveFileExA(tmp_path.c_str(), path.c_str(), 
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    const bool moved = std::rename(tmp_path.c_str(), path.c_str()) == 0;
+#endif
+    if(!moved){
+        throw std::runtime_error("Cannot move checkpoint to " + path);
+    }
+}
+
+MappedCheckpoint::MappedCheckpoint(const std::string& path)
+    :_file(path.c_str(), ip::read_only), _region(_file, ip::copy_on_write)
+{
+    const char* base = static_cast<const char*>(_region.get_address());
+    const uint64_t size = _region.get_size();
+    if(size < sizeof(Header)){
+        throw std::runtime_error("Invalid checkpoint " + path);
+    }
+    std::memcpy(&_header, base, sizeof(Header));
+    if(std::memcmp(_header.magic, magic, sizeof(magic)) != 0){
+        throw std::runtime_error("Invalid checkpoint " + path);
+    }
+    if(_header.version != version){
+        throw std::runtime_error("Unsupported checkpoint version " 
+            + std::to_string(_header.version));
+    }
+    if(_header.params_offset + _header.num_params * sizeof(float) > size ||
+        _header.state_offset + _header.state_size * sizeof(float) > size){
+        throw std::runtime_error("Truncated checkpoint " + path);
+    }
+
+    const char* it = base + sizeof(Header);
+    const char* records_end = base + _header.params_offset;
+    auto read = [&](void* dst, size_t n){
+        if(it + n > records_end){
+            throw std::runtime_error("Corrupted checkpoint " + path);
+        }
+        std::memcpy(dst, it, n);
+        it += n;
+    };
+    _layers.resize(_header.num_layers);
+    for(LayerRecord& layer : _layers){
+        uint32_t length, rank;
+        int64_t value;
+        read(&length, sizeof(length));
+        layer.descriptor.resize(length);
+        read(layer.descriptor.data(), length);
+        read(&rank, sizeof(rank));
+        layer.out_shape.resize(rank);
+        for(Index& d : layer.out_shape){
+            read(&value, sizeof(value));
+            d = static_cast<Index>(value);
+        }
+        read(&value, sizeof(value));
+        layer.num_params = static_cast<Index>(value);
+    }
+}
+
+float* MappedCheckpoint::params(){
+    return reinterpret_cast<float*>(
+        static_cast<char*>(_region.get_address()) + _header.params_offset);
+}
+
+const float* MappedCheckpoint::state(){
+    return reinterpret_cast<const float*>(
+        static_cast<char*>(_region.get_address()) + _header.state_offset);
+}
+
+}
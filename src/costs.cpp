@@ -20,7 +20,7 @@ void MSE::grad(
         tmap_t y,
         tmap_t grad,
         ThreadPoolDevice* device){
-    mse_grad_fun(a, y, grad, device);
+    _loss = mse_grad_fun(a, y, grad, device);
 }
 
 void MSE::act(tmap_t z, 
@@ -28,25 +28,37 @@ void MSE::act(tmap_t z,
     act = z;
 }
 
+void CrossEntropy::init(TensorShape&& shape) {
+    CostFunTempl<CrossEntropy>::init(std::move(shape));
+    if (_softmax) {
+        _log_act = Tensor<float, 2>(_shape);
+    }
+}
+
+// With softmax a are the logits and the cost is the categorical one
+// loss() reports, through the same log-softmax
 Tensor<float, 0> CrossEntropy::cost(tmap_t a, 
             tmap_t y, ThreadPoolDevice* device){
-    return cross_entropy_fun(a, y, device, _softmax);
-    //return -a.binaryExpr(y, std::ref(cross_entropy)).sum();
+    if (_softmax) {
+        return softmax_cross_entropy_fun(a, y, device);
+    }
+    return cross_entropy_fun(a, y, device, false);
 }
 
 void CrossEntropy::grad(tmap_t a,
     tmap_t y, tmap_t grad,
     ThreadPoolDevice* device){ 
-    cross_entropy_grad_fun(a, y, grad, device, _softmax);
-    //std::cout << a.chip(0, 1) << "\n\n";
-    //std::cout << y.chip(0, 1) << "\n\n";
-    //std::cout << grad.chip(0, 1) << "\n\n";
+    if (_softmax) {
+        _loss = softmax_cross_entropy_grad_fun(a, _log_act, y, grad, device);
+        return;
+    }
+    _loss = cross_entropy_loss_grad_fun(a, y, grad, device);
 }
 
 void CrossEntropy::act(tmap_t z, 
     tmap_t act, ThreadPoolDevice* device) {
     if (_softmax) {
-        softmax_fun(z, act, device);
+        log_softmax_fun(z, act, _log_act, device);
     }
     else {
         act.device(*device) = z;
@@ -1,5 +1,6 @@
 
 #include <iostream>
+#include <stdexcept>
 #include "typedefs.h"
 #include "layers.h"
 #include "utils.h"
@@ -9,6 +10,12 @@
 
 inline const Eigen::array<Eigen::IndexPair<int>, 1> product_dims = 
   {Eigen::IndexPair<int>(1, 0) };
+// A * B^T and A^T * B, the contraction reads the operands transposed
+// instead of shuffling them into a temporary first
+inline const Eigen::array<Eigen::IndexPair<int>, 1> product_dims_bt = 
+  {Eigen::IndexPair<int>(1, 1) };
+inline const Eigen::array<Eigen::IndexPair<int>, 1> product_dims_at = 
+  {Eigen::IndexPair<int>(0, 0) };
 
 // Util class for weight initialization
 class NormalSample
@@ -27,6 +34,9 @@ BaseLayer::BaseLayer(size_t out_dims, size_t in_dims, std::string_view d)
 BaseLayer* BaseLayer::next(){return _next;}
 BaseLayer* BaseLayer::prev(){return _prev;}
 std::string BaseLayer::which() { return _descriptor; }
+void BaseLayer::fwdSparse(const SparseBatch&, ThreadPoolDevice*){
+    throw std::runtime_error(_descriptor + " does not take sparse input");
+}
 // Fully connected layer
 FCLayer::FCLayer(Index size) 
     :Layer{std::array<Index, 1>{size}}, _shape{size}
@@ -38,92 +48,280 @@ void FCLayer::initParams(){
     _in_shape = prev_shape();
     std::copy(_in_shape.begin(), _in_shape.end(), _in_batch_shape.begin());
 
-    std::array<Index, 2> temp {_out_shape[0], _in_shape[0]};
-    NormalSample sampleFun(0.0f, 1.0f / std::sqrt(
-        static_cast<float>(temp[0] * temp[1])
-    ));
-    _weights = weight_t(temp).unaryExpr(std::ref(sampleFun));
-    _biases = bias_t(_shape[0]).unaryExpr(std::ref(sampleFun));
+    _weight_shape = {_out_shape[0], _in_shape[0]};
+    _bias_size = _shape[0];
+}
+
+void FCLayer::sampleParams(float std){
+    NormalSample sampleFun(0.0f, std);
+    _weights = _weights.unaryExpr(std::ref(sampleFun));
+    _biases = _biases.unaryExpr(std::ref(sampleFun));
+}
+
+void FCLayer::resetParams(){
+    sampleParams(1.0f / std::sqrt(
+        static_cast<float>(_weight_shape[0] * _weight_shape[1])));
 }
 
 void FCLayer::init(Index batch_size){
+    sync();
     _out_batch_shape.back() = batch_size;
     _in_batch_shape.back() = batch_size;
     _act = out_t(_out_batch_shape); 
     _grad = in_t(_in_batch_shape); 
-    _winputs = in_t(_in_batch_shape);
-    _nabla_b = nabla_b_t(_out_batch_shape); 
-    _nabla_w = nabla_weight_t(_out_batch_shape); 
+    if(!grad_from_act()){
+        _winputs = stash_t(_out_batch_shape);
+    }
+    _delta = Tensor<float, 2>(_out_batch_shape);
+}
+
+// Weighted inputs are computed in float, with mixed precision in _act 
+// and only their saved copy is rounded
+Tensor<float, 2>& FCLayer::weighted_inputs(){
+#ifdef NNN_MIXED_PRECISION
+    return _act;
+#else
+    return grad_from_act() ? _act : _winputs;
+#endif
+}
+
+void FCLayer::activate(ThreadPoolDevice* device){
+    if(grad_from_act()){
+        act(_act, _act, device);
+        return;
+    }
+#ifdef NNN_MIXED_PRECISION
+    _winputs.device(*device) = _act.cast<storage_t>();
+    act(_act, _act, device);
+#else
+    act(_winputs, _act, device);
+#endif
 }
 
 void FCLayer::fwd(ThreadPoolDevice* device){
     assert(_prev != nullptr);
-    _winputs = vecSum(_weights.contract(prev_act(), 
-        product_dims), _biases, false);
-    act(_winputs, _act, device);
+    const std::array<Index, 2> bias_shape{_out_shape[0], 1};
+    const std::array<Index, 2> bias_bcast{1, _out_batch_shape[1]};
+    _sparse_input = nullptr;
+    with_prev_act([&](auto x){
+        weighted_inputs().device(*device) = _weights.contract(cast_to<float>(x), product_dims)
+            + _biases.reshape(bias_shape).broadcast(bias_bcast);
+    });
+    activate(device);
+}
+
+void FCLayer::fwdSparse(const SparseBatch& input, ThreadPoolDevice* device){
+    assert(input.rows() == _in_shape[0] && input.batch() == _out_batch_shape[1]);
+    _sparse_input = &input;
+    sparse_fc(input, _weights, _biases, weighted_inputs(), device);
+    activate(device);
+}
+
+// Deltas in one pass from the activations or the saved weighted inputs
+void FCLayer::deltas(const TensorMap<Tensor<float, 2>>& grad, ThreadPoolDevice* device){
+    if(grad_from_act()){
+        grad_act(_act, grad, _delta, device);
+        return;
+    }
+#ifdef NNN_MIXED_PRECISION
+    _delta.device(*device) = _winputs.cast<float>();
+    grad_act(_delta, grad, _delta, device);
+#else
+    grad_act(_winputs, grad, _delta, device);
+#endif
 }
 
 void FCLayer::fwd(TensorWrapper<float>&&, ThreadPoolDevice* device){}
 void FCLayer::bwd(TensorWrapper<float>&& cost_grad, ThreadPoolDevice* device){
     assert(_next == nullptr);
-    Tensor<float, 2> temp(_winputs.dimensions());
-    grad_act(_winputs, temp, device);
-    _nabla_b = cost_grad.get(_out_batch_shape) * temp;
-    //_nabla_b = cost_grad.get(_out_batch_shape) * grad_act(_winputs);
-    _nabla_w = _nabla_b.contract(transposed(prev_act()), product_dims);
-    _grad = transposed(_weights).contract(_nabla_b, product_dims);
+    deltas(cost_grad.get(_out_batch_shape), device);
+    bwd_products(device);
 }
 
 void FCLayer::bwd(ThreadPoolDevice* device){
     assert(_next != nullptr);
-    Tensor<float, 2> temp(_winputs.dimensions());
-    temp.setConstant(0.0f);
-    grad_act(_winputs, temp, device);
-    //std::cout << temp.chip(0, 1)<< "\n\n";
-    //Tensor<float, 2> test = next_grad();
-    //std::cout << test.chip(0, 1)<< "\n\n";
-    _nabla_b = next_grad() * temp;
-    //_nabla_b = next_grad() * grad_act(_winputs);
-    _nabla_w = _nabla_b.contract(
-        transposed(prev_act()), product_dims);
+    TensorWrapper<storage_t> stored = next_stored_grad();
+    if(stored.data != nullptr){
+        // widened once, deltas reads it more than once
+        Tensor<float, 2> grad(_out_batch_shape);
+        grad.device(*device) = stored.get(_out_batch_shape).cast<float>();
+        deltas(TensorMap<Tensor<float, 2>>(grad.data(), _out_batch_shape), device);
+    }else{
+        deltas(next_grad_wrap().get(_out_batch_shape), device);
+    }
+    bwd_products(device);
+}
+
+// Weight, bias and input gradients from the deltas. They only read the
+// deltas, so they run concurrently on the pool: the weight and bias
+// gradients are launched asynchronously while the input gradient is
+// computed, and are left running for the previous layers' bwd until sync
+void FCLayer::bwd_products(ThreadPoolDevice* device){
+    sync();
+    _pending = std::make_shared<Barrier>(_sparse_input ? 1 : 2);
+    auto done = [pending = _pending.get()](){ pending->Notify(); };
+    if(_sparse_input){
+        sparse_weight_grad(_delta, *_sparse_input, _nabla_w, device, _accumulate);
+    }else{
+        with_prev_act([&](auto x){
+            if(_accumulate){
+                _nabla_w.device(*device, done) = _nabla_w 
+                    + _delta.contract(cast_to<float>(x), product_dims_bt);
+            }else{
+                _nabla_w.device(*device, done) = _delta.contract(cast_to<float>(x), product_dims_bt);
+            }
+        });
+    }
+    if(_accumulate){
+        _nabla_bias.device(*device, done) = _nabla_bias + _delta.sum(dims_rowwise);
+    }else{
+        _nabla_bias.device(*device, done) = _delta.sum(dims_rowwise);
+    }
+    // nothing consumes the gradient of the input layer
+    if(_prev->prev() != nullptr){
+        _grad.device(*device) = _weights.contract(_delta, product_dims_at);
+    }
+}
+
+void FCLayer::sync(){
+    if(_pending){
+        _pending->Wait();
+        _pending.reset();
+    }
+}
+
+LayerMemory FCLayer::memory(){
+    LayerMemory m = Layer::memory();
+    m.scratch += _delta.size() * sizeof(float);
+    return m;
+}
 
-    _grad = transposed(_weights).contract(_nabla_b, product_dims);
+void FCLayer::release(){
+    sync();
+    Layer::release();
+    _delta = Tensor<float, 2>();
 }
 
 
-// Sigmoid layer
+LayerWork FCLayer::work(){
+    const double in = static_cast<double>(_in_shape[0]);
+    const double out = static_cast<double>(_out_shape[0]);
+    const double batch = static_cast<double>(_out_batch_shape[1]);
+    const double f = sizeof(float);
+    LayerWork w;
+    // product, bias and activation
+    w.fwd_flops = 2 * out * in * batch + 2 * out * batch;
+    w.fwd_bytes = f * (out * in + in * batch + 3 * out * batch);
+    // deltas, weight and (but for the first layer) input gradients
+    const double input_grad = _prev->prev() != nullptr ? 1.0 : 0.0;
+    w.bwd_flops = 2 * out * batch + (2 + 2 * input_grad) * out * in * batch;
+    w.bwd_bytes = f * ((1 + input_grad) * out * in + (1 + input_grad) * in * batch
+        + 4 * out * batch + out);
+    return w;
+}
+
+// Sigmoid, tanh and softmax layers take their derivatives from their
+// activations, the forward exp/tanh is not run again in bwd
 SigmoidLayer::SigmoidLayer(Index size) :FCLayer{size}{}
 
 void
 SigmoidLayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
-    sigmoid_fun(z, out, device);
+    _op.fwd(z, out, device);
 }
 
 void
-SigmoidLayer::grad_act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
-    sigmoid_grad_fun(z, out, device);
+SigmoidLayer::grad_act(const Tensor<float, 2>& a, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.bwd(a, grad, out, device);
 }
 
 // Tanh Layer
+TanhLayer::TanhLayer(Index size) :FCLayer{size}{}
+
 void
 TanhLayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
-    tanh_fun(z, out, device);
+    _op.fwd(z, out, device);
 }
 
 void
-TanhLayer::grad_act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
-    tanh_grad_fun(z, out, device);
+TanhLayer::grad_act(const Tensor<float, 2>& a, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.bwd(a, grad, out, device);
 }
 
 // SoftMax Layer
+SoftMaxLayer::SoftMaxLayer(Index size) :FCLayer{size}{}
+
 void
 SoftMaxLayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
     softmax_fun(z, out, device);
 }
 
 void
-SoftMaxLayer::grad_act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
-    softmax_grad_fun(z, out, device);
+SoftMaxLayer::grad_act(const Tensor<float, 2>& a, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    out.device(*device) = grad * a * (1.0f - a);
+}
+
+// ReLU layers, their activations are their derivative masks. Weights 
+// start with variance 2 / inputs (He) so activations keep their scale 
+// through the rectifiers
+ReLULayer::ReLULayer(Index size) :FCLayer{size}{}
+
+void ReLULayer::resetParams(){
+    sampleParams(std::sqrt(2.0f / static_cast<float>(_weight_shape[1])));
+}
+
+void
+ReLULayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.fwd(z, out, device);
+}
+
+void
+ReLULayer::grad_act(const Tensor<float, 2>& a, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.bwd(a, grad, out, device);
+}
+
+LeakyReLULayer::LeakyReLULayer(Index size, float slope) 
+    :FCLayer{size}, _op{slope}
+{
+    if(slope < 0.0f){
+        throw std::invalid_argument("Leaky ReLU slope must not be negative");
+    }
+}
+
+void LeakyReLULayer::resetParams(){
+    sampleParams(std::sqrt(2.0f / static_cast<float>(_weight_shape[1])));
+}
+
+void
+LeakyReLULayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.fwd(z, out, device);
+}
+
+void
+LeakyReLULayer::grad_act(const Tensor<float, 2>& a, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.bwd(a, grad, out, device);
+}
+
+// GELU Layer
+GELULayer::GELULayer(Index size) :FCLayer{size}{}
+
+void GELULayer::resetParams(){
+    sampleParams(std::sqrt(2.0f / static_cast<float>(_weight_shape[1])));
+}
+
+void
+GELULayer::act(const Tensor<float, 2>& z, Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.fwd(z, out, device);
+}
+
+void
+GELULayer::grad_act(const Tensor<float, 2>& z, const TensorMap<Tensor<float, 2>>& grad,
+    Tensor<float, 2>& out, ThreadPoolDevice* device){
+    _op.bwd(z, grad, out, device);
 }
 
 // Convolutional layer
@@ -137,20 +335,23 @@ ConvolLayer::ConvolLayer(std::array<Index, 3> shape)
     channels_shape[1] = 1;
     channels_shape[2] = shape[1];
     channels_shape[3] = shape[2];
+    _weight_shape = channels_shape;
+}
+
+void ConvolLayer::resetParams(){
     NormalSample sampleFun(0.0f, 1.0f / std::sqrt(
-        static_cast<float>(shape[1] * shape[2])
+        static_cast<float>(_shape[1] * _shape[2])
     ));
-    _weights = weight_t(channels_shape).unaryExpr(std::ref(sampleFun));
-    _nabla_w = nabla_weight_t(channels_shape);
+    _weights = _weights.unaryExpr(std::ref(sampleFun));
 }
 
 void ConvolLayer::initParams(){
     _in_shape = prev_shape();
     _out_shape = {
         1,
-        _in_shape[1] - _weights.dimension(2) + 1,
-        _in_shape[2] - _weights.dimension(3) + 1,
-        _in_shape[3] * _weights.dimension(0)
+        _in_shape[1] - _shape[1] + 1,
+        _in_shape[2] - _shape[2] + 1,
+        _in_shape[3] * _shape[0]
     }; 
 }
 
@@ -168,7 +369,9 @@ void ConvolLayer::init(Index batch_size){
 }
 
 void ConvolLayer::fwd(ThreadPoolDevice* device){
-    _act.device(*device) = convolveBatch(prev_act(), _weights);
+    with_prev_act([&](auto x){
+        _act.device(*device) = cast_to<storage_t>(convolveBatch(cast_to<float>(x), _weights));
+    });
 
     //imwrite(this->_act.chip(0, 4).chip(0, 3).chip(0, 0), "./_convol1");
     //imwrite(this->_act.chip(10, 4).chip(0, 3).chip(0, 0), "./_convol2");
@@ -195,17 +398,37 @@ void ConvolLayer::bwd(ThreadPoolDevice* device) {
         depth,
         _out_batch_shape[4],
     };
-    _nabla_w.setConstant(0.0f);
-    for (Index k{ 0 }; k < in_depth; k++) {
-        offsets_output[3] = k * depth;
-        _grad.chip(k, 3).device(*device) = backwardsConvolveInput(
-            next_grad().slice(offsets_output, extents_output),
-            _weights, im_rows, im_cols);
-        _nabla_w.device(*device) += backwardsConvolveKernel(
-            prev_act().chip(k, 3),
-            next_grad().slice(offsets_output, extents_output),
-            ker_rows, ker_cols);
+    if (!_accumulate) {
+        _nabla_w.setConstant(0.0f);
     }
+    with_prev_act([&](auto x){
+        with_next_grad([&](auto dy){
+            for (Index k{ 0 }; k < in_depth; k++) {
+                offsets_output[3] = k * depth;
+                auto dy_k = cast_to<float>(dy.slice(offsets_output, extents_output));
+                _grad.chip(k, 3).device(*device) = cast_to<storage_t>(
+                    backwardsConvolveInput(dy_k, _weights, im_rows, im_cols));
+                _nabla_w.device(*device) += backwardsConvolveKernel(
+                    cast_to<float>(x.chip(k, 3)), dy_k, ker_rows, ker_cols);
+            }
+        });
+    });
+}
+
+LayerWork ConvolLayer::work(){
+    const double batch = static_cast<double>(_out_batch_shape.back());
+    const double in_size = static_cast<double>(_in_shape[1] * _in_shape[2] * _in_shape[3]);
+    const double out_size = static_cast<double>(_out_shape[1] * _out_shape[2] * _out_shape[3]);
+    const double kernel = static_cast<double>(_shape[1] * _shape[2]);
+    const double f = sizeof(float);
+    const double a = sizeof(storage_t);
+    LayerWork w;
+    w.fwd_flops = 2 * out_size * kernel * batch;
+    w.fwd_bytes = a * (in_size * batch + out_size * batch) + f * kernel * _shape[0];
+    // input and kernel gradients
+    w.bwd_flops = 2 * w.fwd_flops;
+    w.bwd_bytes = a * (2 * in_size * batch + 2 * out_size * batch) + f * 2 * kernel * _shape[0];
+    return w;
 }
 
 PoolingLayer::PoolingLayer(std::array<Index, 2> shape, Index stride)
@@ -236,6 +459,31 @@ void PoolingLayer::init(Index batch_size){
     _act = out_t(_out_batch_shape);
     _argmax = Tensor<Index, 5>(_out_batch_shape);
 }
+LayerWork PoolingLayer::work(){
+    const double batch = static_cast<double>(_out_batch_shape.back());
+    const double in_size = static_cast<double>(_in_shape[1] * _in_shape[2] * _in_shape[3]);
+    const double out_size = static_cast<double>(_out_shape[1] * _out_shape[2] * _out_shape[3]);
+    const double f = sizeof(storage_t);
+    LayerWork w;
+    // one comparison per window element
+    w.fwd_flops = out_size * _shape[0] * _shape[1] * batch;
+    w.fwd_bytes = f * (in_size + out_size) * batch + sizeof(Index) * out_size * batch;
+    w.bwd_flops = 0.0;
+    w.bwd_bytes = f * (in_size + out_size) * batch + sizeof(Index) * out_size * batch;
+    return w;
+}
+
+LayerMemory PoolingLayer::memory(){
+    LayerMemory m = Layer<PoolingLayer>::memory();
+    m.scratch += _argmax.size() * sizeof(Index);
+    return m;
+}
+
+void PoolingLayer::release(){
+    Layer<PoolingLayer>::release();
+    _argmax = Tensor<Index, 5>();
+}
+
 void PoolingLayer::fwd(TensorWrapper<float>&&, ThreadPoolDevice* device){}
 void PoolingLayer::bwd(TensorWrapper<float>&&, ThreadPoolDevice* device){}
 
@@ -249,7 +497,9 @@ void PoolingLayer::fwd(ThreadPoolDevice* device) {
     const Index depth = _in_shape[3];
     const Index batch = _in_batch_shape[4];
 
-    max_pooling(prev_act(), ir, ic, depth, batch, kr, kc, stride, _act, _argmax);
+    with_prev_act([&](auto x){
+        max_pooling(x, ir, ic, depth, batch, kr, kc, stride, _act, _argmax);
+    });
 }
 
 void PoolingLayer::bwd(ThreadPoolDevice* device) {
@@ -258,17 +508,18 @@ void PoolingLayer::bwd(ThreadPoolDevice* device) {
     const Index depth = _out_shape[3];
     const Index batch= _out_batch_shape[4];
     
-    Tensor<float, 5> grad = next_grad();
-    _grad.setConstant(0.0f);
-    Index idx_flat = 0;
-    for(Index i{0}; i < batch; i++){ // batch
-        for(Index k{0}; k < depth; k++){ // depth
-            for(Index r{0}; r < outr; r++){ // rows
-                for(Index c{0}; c < outc; c++){ // cols
-                    idx_flat = _argmax(0, r, c, k, i);
-                    _grad(idx_flat) = grad(0, r, c, k, i);
+    _grad.setZero();
+    with_next_grad([&](auto grad){
+        Index idx_flat = 0;
+        for(Index i{0}; i < batch; i++){ // batch
+            for(Index k{0}; k < depth; k++){ // depth
+                for(Index r{0}; r < outr; r++){ // rows
+                    for(Index c{0}; c < outc; c++){ // cols
+                        idx_flat = _argmax(0, r, c, k, i);
+                        _grad(idx_flat) = static_cast<storage_t>(grad(0, r, c, k, i));
+                    }
                 }
             }
         }
-    }
+    });
 }
@@ -0,0 +1,100 @@
+#include <iomanip>
+#include "memory_report.h"
+
+namespace mem
+{
+
+static const Role roles[] = { Role::Activation, Role::Gradient, Role::Weights,
+    Role::Optimizer, Role::Input, Role::Scratch };
+
+const char* role_name(Role role) {
+    switch (role) {
+    case Role::Activation: return "activation";
+    case Role::Gradient: return "gradient";
+    case Role::Weights: return "weights";
+    case Role::Optimizer: return "optimizer";
+    case Role::Input: return "input";
+    case Role::Scratch: return "scratch";
+    }
+    return "";
+}
+
+void MemoryReport::add(const std::string& owner, Role role, size_t bytes) {
+    if (bytes > 0) {
+        _entries.push_back({ owner, role, bytes });
+    }
+}
+
+size_t MemoryReport::total() const {
+    size_t sum{ 0 };
+    for (const Entry& e : _entries) {
+        sum += e.bytes;
+    }
+    return sum;
+}
+
+size_t MemoryReport::total(Role role) const {
+    size_t sum{ 0 };
+    for (const Entry& e : _entries) {
+        sum += e.role == role ? e.bytes : 0;
+    }
+    return sum;
+}
+
+size_t MemoryReport::total(const std::string& owner) const {
+    size_t sum{ 0 };
+    for (const Entry& e : _entries) {
+        sum += e.owner == owner ? e.bytes : 0;
+    }
+    return sum;
+}
+
+std::ostream& operator<<(std::ostream& os, const MemoryReport& report) {
+    // owners in the order they were added
+    std::vector<std::string> owners;
+    for (const MemoryReport::Entry& e : report.entries()) {
+        if (owners.empty() || owners.back() != e.owner) {
+            owners.push_back(e.owner);
+        }
+    }
+    auto kb = [](size_t bytes) { return bytes / 1024.0; };
+
+    os << std::left << std::setw(28) << "Owner (KB)" << std::right;
+    for (Role role : roles) {
+        os << std::setw(12) << role_name(role);
+    }
+    os << std::setw(12) << "total" << "\n";
+    os << std::fixed << std::setprecision(1);
+    for (const std::string& owner : owners) {
+        os << std::left << std::setw(28) << owner << std::right;
+        size_t sum{ 0 };
+        for (Role role : roles) {
+            size_t bytes{ 0 };
+            for (const MemoryReport::Entry& e : report.entries()) {
+                bytes += (e.owner == owner && e.role == role) ? e.bytes : 0;
+            }
+            sum += bytes;
+            os << std::setw(12) << kb(bytes);
+        }
+        os << std::setw(12) << kb(sum) << "\n";
+    }
+    os << std::left << std::setw(28) << "Total" << std::right;
+    for (Role role : roles) {
+        os << std::setw(12) << kb(report.total(role));
+    }
+    os << std::setw(12) << kb(report.total()) << "\n";
+
+    if (tracking_allocations) {
+        os << "Allocations per step: " << report.eigen_allocations_per_step
+            << " Eigen, " << report.heap_allocations_per_step << " new ("
+            << kb(static_cast<size_t>(report.heap_bytes_per_step)) << " KB), "
+            << "counted process wide, operator new is replaced while tracking\n";
+    }
+    else {
+        os << "Allocations per step: build with NNN_TRACK_ALLOCATIONS to count them\n";
+    }
+    os << std::defaultfloat;
+    return os;
+}
+
+}
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "optimizers.h"
+
+namespace optim
+{
+
+typedef Eigen::Map<Eigen::ArrayXf> array_t;
+typedef Eigen::Map<const Eigen::ArrayXf> const_array_t;
+
+// Generic Optimizer
+void Optimizer::init(const std::vector<Parameter>& params){
+    auto same = [](const Parameter& a, const Parameter& b){
+        return a.value.data == b.value.data && a.value._size == b.value._size
+            && a.grad.data == b.grad.data;
+    };
+    if(_params.size() == params.size() && 
+        std::equal(_params.begin(), _params.end(), params.begin(), same)){
+        return;
+    }
+    _params = params;
+    _offsets.resize(_params.size());
+    _total = 0;
+    for(size_t i{0}; i < _params.size(); i++){
+        _offsets[i] = _total;
+        _total += static_cast<Index>(_params[i].value._size);
+    }
+    _state = Tensor<float, 1>(slots() * _total);
+    _state.setZero();
+    _t = 0;
+}
+
+void Optimizer::restore(const float* state, Index size, Index steps){
+    if(size != _state.size()){
+        throw std::runtime_error("Optimizer state does not match the parameters");
+    }
+    std::copy_n(state, size, _state.data());
+    _t = steps;
+}
+
+void Optimizer::step(float scale, ThreadPoolDevice* device){
+    if(_total == 0){
+        return;
+    }
+    _t++;
+    prepare();
+    const double bytes = static_cast<double>((3 + 2 * slots()) * sizeof(float));
+    // All parameters are split as one range, so small tensors (biases)
+    // do not get a launch of their own
+    device->parallelFor(_total, Eigen::TensorOpCost(bytes, bytes, cost()),
+        [this, scale](Index first, Index last){
+            size_t i = std::upper_bound(_offsets.begin(), _offsets.end(), first)
+                - _offsets.begin() - 1;
+            while(first < last){
+                const Index begin = _offsets[i];
+                const Index end = std::min(last, 
+                    begin + static_cast<Index>(_params[i].value._size));
+                const Index n = std::min(end - first, tile);
+                const Index local = first - begin;
+                kernel(_params[i].value.data + local, _params[i].grad.data + local,
+                    _state.data() + first, n, scale, _params[i].decay);
+                first += n;
+                if(first == end){
+                    i++;
+                }
+            }
+        });
+}
+
+// SGD
+void SGD::kernel(float* value, const float* grad, float*, 
+    Index n, float scale, bool decay) const {
+    array_t w(value, n);
+    const_array_t g(grad, n);
+    const float shrink = decay ? 1.0f - lr * _weight_decay : 1.0f;
+    w = shrink * w - (lr * scale) * g;
+}
+
+// Momentum
+void Momentum::kernel(float* value, const float* grad, float* state, 
+    Index n, float scale, bool decay) const {
+    array_t w(value, n);
+    const_array_t g(grad, n);
+    array_t v(state, n);
+    const float wd = decay ? _weight_decay : 0.0f;
+    v = _momentum * v + scale * g + wd * w;
+    if(_nesterov){
+        w -= lr * (scale * g + wd * w + _momentum * v);
+    }else{
+        w -= lr * v;
+    }
+}
+
+// Adam
+void Adam::prepare(){
+    _corr1 = 1.0f / (1.0f - std::pow(_beta1, static_cast<float>(_t)));
+    _corr2 = 1.0f / (1.0f - std::pow(_beta2, static_cast<float>(_t)));
+}
+
+void Adam::kernel(float* value, const float* grad, float* state, 
+    Index n, float scale, bool decay) const {
+    array_t w(value, n);
+    const_array_t g(grad, n);
+    array_t m(state, n);
+    array_t v(state + _total, n);
+    const float wd = decay ? _weight_decay : 0.0f;
+    if(_decoupled){
+        m = _beta1 * m + (1.0f - _beta1) * scale * g;
+        v = _beta2 * v + (1.0f - _beta2) * (scale * g).square();
+        w -= lr * ((_corr1 * m) / ((_corr2 * v).sqrt() + _eps) + wd * w);
+    }else{
+        m = _beta1 * m + (1.0f - _beta1) * (scale * g + wd * w);
+        v = _beta2 * v + (1.0f - _beta2) * (scale * g + wd * w).square();
+        w -= lr * (_corr1 * m) / ((_corr2 * v).sqrt() + _eps);
+    }
+}
+
+}
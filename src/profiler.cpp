@@ -0,0 +1,65 @@
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <stdexcept>
+#include "profiler.h"
+
+void Profiler::write_chrome_trace(const std::string& path) const{
+    std::ofstream fout(path);
+    if(!fout){
+        throw std::runtime_error("Could not open " + path);
+    }
+    fout << "{\"traceEvents\":[\n";
+    for(size_t i{0}; i < _events.size(); i++){
+        const Event& e = _events[i];
+        fout << "{\"name\":\"" << e.name << "\",\"cat\":\"" << e.phase
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << e.start_us
+            << ",\"dur\":" << e.duration_us << ",\"args\":{\"flops\":" << e.flops
+            << ",\"bytes\":" << e.bytes << "}}";
+        fout << (i + 1 < _events.size() ? ",\n" : "\n");
+    }
+    fout << "],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void Profiler::summary(std::ostream& os) const{
+    struct Totals
+    {
+        size_t calls{0};
+        double us{0.0};
+        double flops{0.0};
+        double bytes{0.0};
+    };
+    // keep the order in which layers and phases first appear
+    std::vector<std::pair<std::string, const char*>> order;
+    std::map<std::pair<std::string, std::string>, Totals> totals;
+    double total_us{0.0};
+    for(const Event& e : _events){
+        auto key = std::make_pair(e.name, std::string(e.phase));
+        if(totals.find(key) == totals.end()){
+            order.emplace_back(e.name, e.phase);
+        }
+        Totals& t = totals[key];
+        t.calls++;
+        t.us += e.duration_us;
+        t.flops += e.flops;
+        t.bytes += e.bytes;
+        total_us += e.duration_us;
+    }
+
+    os << std::left << std::setw(32) << "Layer" << std::setw(8) << "Phase"
+        << std::right << std::setw(8) << "Calls" << std::setw(12) << "Total ms"
+        << std::setw(8) << "%" << std::setw(12) << "Avg us" << std::setw(10)
+        << "GFLOP/s" << std::setw(10) << "GB/s" << "\n";
+    os << std::fixed << std::setprecision(2);
+    for(const auto& [name, phase] : order){
+        const Totals& t = totals[std::make_pair(name, std::string(phase))];
+        const double seconds = t.us * 1e-6;
+        os << std::left << std::setw(32) << name << std::setw(8) << phase
+            << std::right << std::setw(8) << t.calls << std::setw(12) << t.us / 1000
+            << std::setw(8) << (total_us > 0 ? 100 * t.us / total_us : 0.0)
+            << std::setw(12) << t.us / t.calls
+            << std::setw(10) << (seconds > 0 ? t.flops / seconds * 1e-9 : 0.0)
+            << std::setw(10) << (seconds > 0 ? t.bytes / seconds * 1e-9 : 0.0) << "\n";
+    }
+    os << std::defaultfloat;
+}
@@ -0,0 +1,306 @@
+#include <cmath>
+#include <stdexcept>
+#include "quantization.h"
+#include "layer_activations.h"
+
+namespace quant
+{
+
+QuantizedWeights quantize_weights(const float* w, Index rows, Index cols){
+    QuantizedWeights q;
+    q.rows = rows;
+    q.cols = cols;
+    q.data.resize(rows * cols);
+    q.scales.resize(rows);
+    for(Index r{0}; r < rows; r++){
+        float amax{0.0f};
+        for(Index c{0}; c < cols; c++){
+            amax = std::max(amax, std::abs(w[r + c * rows]));
+        }
+        const float scale = amax > 0.0f ? amax / 127.0f : 1.0f;
+        q.scales[r] = scale;
+        for(Index c{0}; c < cols; c++){
+            q.data[r * cols + c] = static_cast<int8_t>(
+                std::lround(w[r + c * rows] / scale));
+        }
+    }
+    return q;
+}
+
+static float activation_scale(float amax){
+    return amax > 0.0f ? amax / 127.0f : 1.0f;
+}
+
+// Fully connected
+QuantizedFC::QuantizedFC(const float* weights, const float* biases,
+    Index out_size, Index in_size, float in_scale, Activation act, float slope)
+    :_weights{quantize_weights(weights, out_size, in_size)},
+    _biases(biases, biases + out_size), _out_scales(out_size),
+    _in_scale{in_scale}, _act{act}, _slope{slope}
+{
+    for(Index r{0}; r < out_size; r++){
+        _out_scales[r] = _weights.scales[r] * _in_scale;
+    }
+}
+
+void QuantizedFC::fwd(const float* in, float* out, Index batch,
+    ThreadPoolDevice* device){
+    const Index in_n = in_size();
+    const Index out_n = out_size();
+    _xq.resize(in_n * batch);
+    Eigen::quantize_s8(in, _xq.data(), in_n * batch, _in_scale, device);
+
+    device->parallelFor(batch, Eigen::TensorOpCost(
+            static_cast<double>(in_n + out_n * in_n),
+            static_cast<double>(out_n * sizeof(float)),
+            static_cast<double>(2 * out_n * in_n)),
+        [this, in_n, out_n, out](Index first, Index last){
+            for(Index j{first}; j < last; j++){
+                const int8_t* x = _xq.data() + j * in_n;
+                float* y = out + j * out_n;
+                for(Index r{0}; r < out_n; r++){
+                    y[r] = Eigen::dot_s8(x, _weights.row(r), in_n) * _out_scales[r]
+                        + _biases[r];
+                }
+            }
+        });
+
+    TensorMap<Tensor<float, 2>> y(out, out_n, batch);
+    switch(_act){
+    case Activation::sigmoid:
+        y.device(*device) = y.sigmoid();
+        break;
+    case Activation::tanh:
+        y.device(*device) = y.tanh();
+        break;
+    case Activation::softmax:
+        Eigen::softmax_fun(y, y, device);
+        break;
+    case Activation::relu:
+        activation::ReLU{}.fwd(y, y, device);
+        break;
+    case Activation::leaky_relu:
+        activation::LeakyReLU{_slope}.fwd(y, y, device);
+        break;
+    case Activation::gelu:
+        activation::GELU{}.fwd(y, y, device);
+        break;
+    case Activation::none:
+        break;
+    }
+}
+
+// Convolution
+QuantizedConv::QuantizedConv(const float* kernels, Index depth, Index kr,
+    Index kc, std::array<Index, 4> in_shape, float in_scale)
+    :_kernels{quantize_weights(kernels, depth, kr * kc)}, _out_scales(depth),
+    _in_shape{in_shape}, _kr{kr}, _kc{kc}, _in_scale{in_scale}
+{
+    for(Index d{0}; d < depth; d++){
+        _out_scales[d] = _kernels.scales[d] * _in_scale;
+    }
+}
+
+Index QuantizedConv::in_size() const{
+    return _in_shape[0] * _in_shape[1] * _in_shape[2] * _in_shape[3];
+}
+
+Index QuantizedConv::out_size() const{
+    return (_in_shape[1] - _kr + 1) * (_in_shape[2] - _kc + 1)
+        * _in_shape[3] * _kernels.rows;
+}
+
+void QuantizedConv::fwd(const float* in, float* out, Index batch,
+    ThreadPoolDevice* device){
+    const Index ir = _in_shape[1], ic = _in_shape[2];
+    const Index outr = ir - _kr + 1, outc = ic - _kc + 1;
+    const Index positions = outr * outc;
+    const Index kk = _kr * _kc;
+    const Index depth = _kernels.rows;
+    const Index images = _in_shape[3] * batch;
+    _xq.resize(ir * ic * images);
+    Eigen::quantize_s8(in, _xq.data(), ir * ic * images, _in_scale, device);
+
+    // Every image is unrolled into int8 patches once and reused by
+    // all the kernels
+    device->parallelFor(images, Eigen::TensorOpCost(
+            static_cast<double>(ir * ic + positions * kk),
+            static_cast<double>(positions * depth * sizeof(float)),
+            static_cast<double>(2 * positions * depth * kk)),
+        [=](Index first, Index last){
+            std::vector<int8_t> patches(positions * kk);
+            for(Index m{first}; m < last; m++){
+                const int8_t* im = _xq.data() + m * ir * ic;
+                for(Index x{0}; x < outc; x++){
+                    for(Index y{0}; y < outr; y++){
+                        int8_t* p = patches.data() + (y + outr * x) * kk;
+                        for(Index c{0}; c < _kc; c++){
+                            for(Index r{0}; r < _kr; r++){
+                                p[r + _kr * c] = im[(y + r) + ir * (x + c)];
+                            }
+                        }
+                    }
+                }
+                for(Index d{0}; d < depth; d++){
+                    float* o = out + positions * (d + depth * m);
+                    const int8_t* w = _kernels.row(d);
+                    for(Index p{0}; p < positions; p++){
+                        o[p] = Eigen::dot_s8(patches.data() + p * kk, w, kk)
+                            * _out_scales[d];
+                    }
+                }
+            }
+        });
+}
+
+// Max pooling
+MaxPool::MaxPool(std::array<Index, 4> in_shape, std::array<Index, 4> out_shape,
+    std::array<Index, 2> window, Index stride)
+    :_in_shape{in_shape}, _out_shape{out_shape}, _window{window}, _stride{stride}
+{}
+
+Index MaxPool::in_size() const{
+    return _in_shape[0] * _in_shape[1] * _in_shape[2] * _in_shape[3];
+}
+
+Index MaxPool::out_size() const{
+    return _out_shape[0] * _out_shape[1] * _out_shape[2] * _out_shape[3];
+}
+
+void MaxPool::fwd(const float* in, float* out, Index batch,
+    ThreadPoolDevice* device){
+    const Index ir = _in_shape[1], ic = _in_shape[2];
+    const Index outr = _out_shape[1], outc = _out_shape[2];
+    const Index kr = _window[0], kc = _window[1];
+    const Index stride = _stride;
+    device->parallelFor(_in_shape[3] * batch, Eigen::TensorOpCost(
+            static_cast<double>(ir * ic * sizeof(float)),
+            static_cast<double>(outr * outc * sizeof(float)),
+            static_cast<double>(outr * outc * kr * kc)),
+        [=](Index first, Index last){
+            for(Index m{first}; m < last; m++){
+                const float* im = in + m * ir * ic;
+                float* o = out + m * outr * outc;
+                for(Index w{0}; w < outc; w++){
+                    for(Index h{0}; h < outr; h++){
+                        float v = Eigen::NumTraits<float>::lowest();
+                        for(Index c{w * stride}; c < w * stride + kc; c++){
+                            for(Index r{h * stride}; r < h * stride + kr; r++){
+                                v = std::max(v, im[r + ir * c]);
+                            }
+                        }
+                        o[h + outr * w] = v;
+                    }
+                }
+            }
+        });
+}
+
+// ActivationLayer after convolutions (N = 4) or fully connected layouts
+// (N = 1), nullptr if layer applies another Op
+template<class Op>
+static std::unique_ptr<QuantizedOp> quantize_activation(BaseLayer* layer){
+    const Index size = layer->out_shape().get()[0];
+    if(auto conv_act = dynamic_cast<ActivationLayer<Op, 4>*>(layer)){
+        return std::make_unique<QuantizedActivation<Op>>(conv_act->op(), size);
+    }
+    if(auto fc_act = dynamic_cast<ActivationLayer<Op, 1>*>(layer)){
+        return std::make_unique<QuantizedActivation<Op>>(fc_act->op(), size);
+    }
+    return nullptr;
+}
+
+std::unique_ptr<QuantizedOp> quantize_layer(BaseLayer* layer, float amax){
+    const std::string name = layer->which();
+    if(layer->is_view()){
+        return nullptr;
+    }
+    if(auto fc = dynamic_cast<FCLayer*>(layer)){
+        Activation act = Activation::none;
+        float slope{ 0.0f };
+        if(auto leaky = dynamic_cast<LeakyReLULayer*>(layer)){
+            act = Activation::leaky_relu;
+            slope = leaky->slope();
+        }else if(dynamic_cast<ReLULayer*>(layer)){
+            act = Activation::relu;
+        }else if(dynamic_cast<GELULayer*>(layer)){
+            act = Activation::gelu;
+        }else if(dynamic_cast<SigmoidLayer*>(layer)){
+            act = Activation::sigmoid;
+        }else if(dynamic_cast<TanhLayer*>(layer)){
+            act = Activation::tanh;
+        }else if(dynamic_cast<SoftMaxLayer*>(layer)){
+            act = Activation::softmax;
+        }
+        std::vector<Parameter> params = fc->parameters();
+        return std::make_unique<QuantizedFC>(params[0].value.data,
+            params[1].value.data, fc->out_shape().get()[0],
+            fc->in_shape().get()[0], activation_scale(amax), act, slope);
+    }
+    if(auto conv = dynamic_cast<ConvolLayer*>(layer)){
+        auto in_shape = conv->in_shape().get<std::array<Index, 4>>();
+        auto out_shape = conv->out_shape().get<std::array<Index, 4>>();
+        const Index kr = in_shape[1] - out_shape[1] + 1;
+        const Index kc = in_shape[2] - out_shape[2] + 1;
+        const Index depth = out_shape[3] / in_shape[3];
+        return std::make_unique<QuantizedConv>(conv->parameters()[0].value.data,
+            depth, kr, kc, in_shape, activation_scale(amax));
+    }
+    if(auto pool = dynamic_cast<PoolingLayer*>(layer)){
+        return std::make_unique<MaxPool>(
+            pool->in_shape().get<std::array<Index, 4>>(),
+            pool->out_shape().get<std::array<Index, 4>>(),
+            pool->window(), pool->stride());
+    }
+    std::unique_ptr<QuantizedOp> act;
+    if((act = quantize_activation<activation::ReLU>(layer))
+        || (act = quantize_activation<activation::LeakyReLU>(layer))
+        || (act = quantize_activation<activation::GELU>(layer))
+        || (act = quantize_activation<activation::Sigmoid>(layer))
+        || (act = quantize_activation<activation::Tanh>(layer))){
+        return act;
+    }
+    throw std::runtime_error("No int8 version of " + name);
+}
+
+// Model
+void QuantizedModel::add(std::unique_ptr<QuantizedOp> op){
+    _ops.push_back(std::move(op));
+}
+
+TensorMap<Tensor<float, 2>> QuantizedModel::fwd(const float* x, Index batch,
+    ThreadPoolDevice* device){
+    const float* in = x;
+    float* out = nullptr;
+    for(size_t i{0}; i < _ops.size(); i++){
+        Tensor<float, 1>& buffer = _buffers[i % 2];
+        const Index size = _ops[i]->out_size() * batch;
+        if(buffer.size() < size){
+            buffer = Tensor<float, 1>(size);
+        }
+        out = buffer.data();
+        _ops[i]->fwd(in, out, batch, device);
+        in = out;
+    }
+    return TensorMap<Tensor<float, 2>>(out, out_size(), batch);
+}
+
+size_t QuantizedModel::bytes() const{
+    size_t total{0};
+    for(const auto& op : _ops){
+        total += op->bytes();
+    }
+    return total;
+}
+
+std::ostream& operator<<(std::ostream& os, const Report& report){
+    os << "Float accuracy: " << report.float_accuracy * 100 << " % ("
+        << report.float_ms << "ms, " << report.float_bytes << " bytes)\n";
+    os << "Int8 accuracy: " << report.int8_accuracy * 100 << " % ("
+        << report.int8_ms << "ms, " << report.int8_bytes << " bytes)\n";
+    os << "Accuracy delta: "
+        << (report.int8_accuracy - report.float_accuracy) * 100 << " %\n";
+    return os;
+}
+
+}
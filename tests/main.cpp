@@ -39,6 +39,31 @@ int main() {
     testFeedFwd();
     std::cout << "--TESTING Backwards-propagation" << "\n";
     testBackProp();
+    testTemporaryInput();
+    std::cout << "--TESTING Checkpoints" << "\n";
+    testCheckpoint();
+    std::cout << "--TESTING Mixed precision storage" << "\n";
+    testMixedPrecision();
+    std::cout << "--TESTING Profiler" << "\n";
+    testProfiler();
+    std::cout << "--TESTING Memory report" << "\n";
+    testMemoryReport();
+    std::cout << "--TESTING Inference engine" << "\n";
+    testInferenceEngine();
+    std::cout << "--TESTING Execution contexts" << "\n";
+    testExecutionContext();
+    std::cout << "--TESTING Gradient accumulation" << "\n";
+    testGradientAccumulation();
+    std::cout << "--TESTING Activation checkpointing" << "\n";
+    testActivationCheckpointing();
+    std::cout << "--TESTING Batch normalization" << "\n";
+    testBatchNorm();
+    std::cout << "--TESTING ReLU layers" << "\n";
+    testReLULayers();
+    std::cout << "--TESTING Static network" << "\n";
+    testStaticSequential();
+    std::cout << "--TESTING Quantized model" << "\n";
+    testQuantizedModel();
     std::cout << "--TESTING Convolution Ops" << "\n";
     testAllOps();
 
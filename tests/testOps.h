@@ -8,6 +8,11 @@
 #include "convolutions.h"
 #include "layer_activations.h"
 #include "cost_funs.h"
+#include "metrics.h"
+#include "eigenFuns.h"
+#include "optimizers.h"
+#include "quantization.h"
+#include "sparse.h"
 
 
 static constexpr float TestPrecision = 1e-3;
@@ -206,6 +211,91 @@ void testTanh(int size, int batch, ThreadPoolDevice* device) {
 	}
 }
 
+void testReLUFamily(int size, int batch, ThreadPoolDevice* device) {
+	Tensor<float, 2> input(size, batch);
+	Tensor<float, 2> grad(size, batch);
+	input.setRandom();
+	input = input - 0.5f;
+	grad.setRandom();
+	Tensor<float, 2> output(size, batch);
+	Tensor<float, 2> delta(size, batch);
+	const float slope{ 0.1f };
+
+	activation::ReLU relu;
+	relu.fwd(input, output, device);
+	relu.bwd(output, grad, delta, device);
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			const float z = input(i, b);
+			AssertAprox(output(i, b), std::max(z, 0.0f), "relu");
+			AssertAprox(delta(i, b), z > 0.0f ? grad(i, b) : 0.0f, "relu grad");
+		}
+	}
+
+	activation::LeakyReLU leaky{ slope };
+	leaky.fwd(input, output, device);
+	leaky.bwd(output, grad, delta, device);
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			const float z = input(i, b);
+			AssertAprox(output(i, b), z > 0.0f ? z : slope * z, "leaky relu");
+			AssertAprox(delta(i, b), (z > 0.0f ? 1.0f : slope) * grad(i, b), "leaky relu grad");
+		}
+	}
+
+	// derivative against central differences of the scalar function
+	activation::GELU gelu;
+	gelu.fwd(input, output, device);
+	gelu.bwd(input, grad, delta, device);
+	auto gelu_fun = [](double z) { return 0.5 * z * (1.0 + std::erf(z / std::sqrt(2.0))); };
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			const double z = input(i, b);
+			const double h{ 1e-4 };
+			const double derivative = (gelu_fun(z + h) - gelu_fun(z - h)) / (2 * h);
+			AssertAprox(output(i, b), static_cast<float>(gelu_fun(z)), "gelu");
+			AssertAprox(delta(i, b), static_cast<float>(derivative * grad(i, b)), "gelu grad");
+		}
+	}
+}
+
+// Derivatives taken from the activations match the ones recomputed from z,
+// with the forward pass run in place as the layers do
+void testSaturatingFromAct(int size, int batch, ThreadPoolDevice* device) {
+	Tensor<float, 2> input(size, batch);
+	Tensor<float, 2> grad(size, batch);
+	input.setRandom();
+	input = (input - 0.5f) * 4.0f;
+	grad.setRandom();
+	Tensor<float, 2> act(size, batch);
+	Tensor<float, 2> delta(size, batch);
+	Tensor<float, 2> expected(size, batch);
+
+	activation::Sigmoid sigmoid;
+	act = input;
+	sigmoid.fwd(act, act, device);
+	sigmoid.bwd(act, grad, delta, device);
+	sigmoid_grad_fun(input, expected, device);
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			AssertAprox(act(i, b), 1.0f / (1.0f + std::exp(-input(i, b))), "sigmoid");
+			AssertAprox(delta(i, b), expected(i, b) * grad(i, b), "sigmoid grad");
+		}
+	}
+
+	activation::Tanh tanh;
+	act = input;
+	tanh.fwd(act, act, device);
+	tanh.bwd(act, grad, delta, device);
+	tanh_grad_fun(input, expected, device);
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			AssertAprox(act(i, b), std::tanh(input(i, b)), "tanh");
+			AssertAprox(delta(i, b), expected(i, b) * grad(i, b), "tanh grad");
+		}
+	}
+}
+
 void testMSE(int size, int batch, ThreadPoolDevice* device) {
 	Tensor<float, 2> input(size, batch);
 	input.setRandom();
@@ -226,7 +316,7 @@ void testMSE(int size, int batch, ThreadPoolDevice* device) {
 	AssertAprox(cost(0), expected, "MSE");
 	
 	Tensor<float, 2> grad(size, batch);
-	mse_grad_fun(input, output, grad, device);
+	AssertAprox(mse_grad_fun(input, output, grad, device), cost(0), "MSE fused loss");
 
 	for (int b{ 0 }; b < batch; b++) {
 		for (int i{ 0 }; i < size; i++) {
@@ -275,6 +365,227 @@ void testCrossEntropy(int size, int batch, ThreadPoolDevice* device) {
 			AssertAprox(grad2(i, b), expected, "MSE grad");
 		}
 	}
+
+	// fused gradient and binary cost, probabilities away from 0 and 1
+	Tensor<float, 2> probs = input * 0.8f + 0.1f;
+	Tensor<float, 0> binary_cost = cross_entropy_fun(probs, output, device, false);
+	Tensor<float, 2> fused_grad(size, batch);
+	Tensor<float, 2> expected_grad(size, batch);
+	cross_entropy_grad_fun(probs, output, expected_grad, device, false);
+	const float fused_cost = cross_entropy_loss_grad_fun(probs, output, fused_grad, device);
+	ASSERT_WITH_MSG(std::abs(fused_cost - binary_cost(0)) < 1e-4f * std::abs(binary_cost(0)),
+		"Fused cross entropy cost");
+	for (int b{ 0 }; b < batch; b++) {
+		for (int i{ 0 }; i < size; i++) {
+			AssertAprox(fused_grad(i, b), expected_grad(i, b), "Fused cross entropy grad");
+		}
+	}
+}
+
+void testSoftmaxCrossEntropy(int size, int batch, ThreadPoolDevice* device) {
+	Tensor<float, 2> input(size, batch);
+	input.setRandom();
+	// large logits must not overflow the exponentials
+	input(0, 0) = 200.0f;
+	Tensor<float, 2> output(size, batch);
+	output.setZero();
+	for (int b{ 0 }; b < batch; b++) {
+		output(b % size, b) = 1.0f;
+	}
+	Tensor<float, 2> act(size, batch);
+	Tensor<float, 2> log_act(size, batch);
+	log_softmax_fun(input, act, log_act, device);
+
+	Tensor<float, 2> grad(size, batch);
+	float cost = softmax_cross_entropy_grad_fun(act, log_act, output, grad, device);
+	float expected_cost = 0;
+	for (int b{ 0 }; b < batch; b++) {
+		float max = input(0, b);
+		for (int i{ 1 }; i < size; i++) {
+			max = std::max(max, input(i, b));
+		}
+		float sum = 0;
+		for (int i{ 0 }; i < size; i++) {
+			sum += std::exp(input(i, b) - max);
+		}
+		for (int i{ 0 }; i < size; i++) {
+			float log_softmax = input(i, b) - max - std::log(sum);
+			float softmax = std::exp(log_softmax);
+			AssertAprox(act(i, b), softmax, "log softmax act");
+			AssertAprox(log_act(i, b), log_softmax, "log softmax");
+			AssertAprox(grad(i, b), softmax - output(i, b), "softmax cross entropy grad");
+			expected_cost -= output(i, b) * log_softmax;
+		}
+	}
+	AssertAprox(cost, expected_cost, "softmax cross entropy");
+	Tensor<float, 0> forward_cost = softmax_cross_entropy_fun(input, output, device);
+	AssertAprox(forward_cost(0), cost, "softmax cross entropy cost");
+}
+
+void testCountCorrect(int size, int batch, ThreadPoolDevice* device) {
+	Tensor<float, 2> pred(size, batch);
+	pred.setRandom();
+	Tensor<float, 2> labels(size, batch);
+	labels.setZero();
+	Index expected = 0;
+	for (int b{ 0 }; b < batch; b++) {
+		int best = 0;
+		for (int i{ 1 }; i < size; i++) {
+			if (pred(i, b) > pred(best, b)) best = i;
+		}
+		int label = b % size;
+		labels(label, b) = 1.0f;
+		expected += (label == best);
+	}
+	Tensor<Index, 1> argmax = batch_argmax(pred);
+	AssertAprox(static_cast<float>(count_correct(pred, labels, device)), 
+		static_cast<float>(expected), "count correct");
+	AssertAprox(static_cast<float>(argmax.dimension(0)), 
+		static_cast<float>(batch), "batch argmax");
+}
+
+void testGather(int size, int batch, ThreadPoolDevice* device) {
+	Tensor<float, 3> input(size, 2, batch);
+	input.setRandom();
+	std::vector<int> indices(batch);
+	for (int b{ 0 }; b < batch; b++) {
+		indices[b] = (b * 7) % batch;
+	}
+	Tensor<float, 3> output(size, 2, batch);
+	gather(input, indices.data(), output, device);
+	for (int b{ 0 }; b < batch; b++) {
+		for (int j{ 0 }; j < 2; j++) {
+			for (int i{ 0 }; i < size; i++) {
+				AssertAprox(output(i, j, b), input(i, j, indices[b]), "gather");
+			}
+		}
+	}
+}
+
+void testQuantization(int size, int batch, ThreadPoolDevice* device) {
+	// int8 dot product, lengths cover the vector loops and their tails
+	for (Index n : {1, 15, 16, 33, 64, 100}) {
+		std::vector<int8_t> x(n), w(n);
+		int32_t expected{ 0 };
+		for (Index i{ 0 }; i < n; i++) {
+			x[i] = static_cast<int8_t>((i * 37) % 255 - 127);
+			w[i] = static_cast<int8_t>(127 - (i * 53) % 255);
+			expected += x[i] * w[i];
+		}
+		ASSERT_WITH_MSG(Eigen::dot_s8(x.data(), w.data(), n) == expected,
+			"Test int8 dot product failed");
+	}
+
+	// int8 fully connected layer against the float product
+	const Index in_size = 4 * size;
+	Tensor<float, 2> weights(size, in_size);
+	Tensor<float, 1> biases(size);
+	Tensor<float, 2> x(in_size, batch);
+	weights.setRandom();
+	biases.setRandom();
+	x.setRandom();
+	weights = weights - 0.5f;
+	Tensor<float, 0> amax = x.abs().maximum();
+	quant::QuantizedFC fc(weights.data(), biases.data(), size, in_size,
+		amax(0) / 127.0f, quant::Activation::none);
+	Tensor<float, 2> y(size, batch);
+	fc.fwd(x.data(), y.data(), batch, device);
+
+	const Eigen::array<Eigen::IndexPair<int>, 1> dims = { Eigen::IndexPair<int>(1, 0) };
+	Tensor<float, 2> expected = weights.contract(x, dims)
+		+ biases.reshape(std::array<Index, 2>{size, 1})
+		.broadcast(std::array<Index, 2>{1, batch});
+	Tensor<float, 0> err = (y - expected).abs().maximum();
+	Tensor<float, 0> range = expected.abs().maximum();
+	ASSERT_WITH_MSG(err(0) < 0.02f * range(0), "Test int8 fully connected failed");
+}
+
+void testSparse(int size, int batch, ThreadPoolDevice* device) {
+	const Index in_size = 8 * size;
+	SparseBatch x(in_size);
+	for (int j{ 0 }; j < batch; j++) {
+		for (int i{ j % 3 }; i < in_size; i += 7) {
+			x.push(i, 0.1f * (i + j));
+		}
+		x.close_sample();
+	}
+	Tensor<float, 2> dense = x.dense();
+	Tensor<float, 2> weights(size, in_size);
+	Tensor<float, 1> biases(size);
+	Tensor<float, 2> delta(size, batch);
+	weights.setRandom();
+	biases.setRandom();
+	delta.setRandom();
+
+	Tensor<float, 2> out(size, batch);
+	sparse_fc(x, weights, biases, out, device);
+	const Eigen::array<Eigen::IndexPair<int>, 1> dims = { Eigen::IndexPair<int>(1, 0) };
+	Tensor<float, 2> expected = weights.contract(dense, dims)
+		+ biases.reshape(std::array<Index, 2>{size, 1})
+		.broadcast(std::array<Index, 2>{1, batch});
+	Tensor<float, 0> err = (out - expected).abs().maximum();
+	AssertAprox(err(0), 0.0f, "sparse forward");
+
+	Tensor<float, 2> nabla_w(size, in_size);
+	nabla_w.setRandom();
+	sparse_weight_grad(delta, x, nabla_w, device);
+	const Eigen::array<Eigen::IndexPair<int>, 1> dims_bt = { Eigen::IndexPair<int>(1, 1) };
+	Tensor<float, 2> expected_w = delta.contract(dense, dims_bt);
+	err = (nabla_w - expected_w).abs().maximum();
+	AssertAprox(err(0), 0.0f, "sparse weight gradient");
+}
+
+void testOptimizers(int size, ThreadPoolDevice* device) {
+	const float lr = 0.1f, mu = 0.9f, scale = 0.5f;
+	const float beta1 = 0.9f, beta2 = 0.999f, eps = 1e-8f, wd = 0.05f;
+	Tensor<float, 1> grad(size);
+	grad.setRandom();
+	Tensor<float, 1> w_sgd(size), w_mom(size), w_adam(size), w_adamw(size), b_adamw(size);
+	w_sgd.setConstant(1.0f);
+	w_mom.setConstant(1.0f);
+	w_adam.setConstant(1.0f);
+	w_adamw.setConstant(1.0f);
+	b_adamw.setConstant(1.0f);
+
+	optim::SGD sgd(lr);
+	optim::Momentum momentum(lr, mu, true);
+	optim::Adam adam(lr, beta1, beta2, eps);
+	sgd.init({ Parameter{TensorWrapper(w_sgd), TensorWrapper(grad)} });
+	momentum.init({ Parameter{TensorWrapper(w_mom), TensorWrapper(grad)} });
+	adam.init({ Parameter{TensorWrapper(w_adam), TensorWrapper(grad)} });
+	// decoupled decay only shrinks the weights, not the biases
+	optim::AdamW adamw(lr, wd, beta1, beta2, eps);
+	adamw.init({ Parameter{TensorWrapper(w_adamw), TensorWrapper(grad), true},
+		Parameter{TensorWrapper(b_adamw), TensorWrapper(grad), false} });
+	const int steps = 3;
+	for (int t{ 0 }; t < steps; t++) {
+		sgd.step(scale, device);
+		momentum.step(scale, device);
+		adam.step(scale, device);
+		adamw.step(scale, device);
+	}
+
+	for (int i{ 0 }; i < size; i++) {
+		const float g = scale * grad(i);
+		float w = 1.0f, v = 0.0f;
+		float wa = 1.0f, m = 0.0f, va = 0.0f;
+		float ww = 1.0f;
+		for (int t{ 1 }; t <= steps; t++) {
+			v = mu * v + g;
+			w -= lr * (g + mu * v);
+			m = beta1 * m + (1 - beta1) * g;
+			va = beta2 * va + (1 - beta2) * g * g;
+			float m_hat = m / (1 - std::pow(beta1, t));
+			float v_hat = va / (1 - std::pow(beta2, t));
+			wa -= lr * m_hat / (std::sqrt(v_hat) + eps);
+			ww -= lr * (m_hat / (std::sqrt(v_hat) + eps) + wd * ww);
+		}
+		AssertAprox(w_sgd(i), 1.0f - steps * lr * g, "SGD");
+		AssertAprox(w_mom(i), w, "Nesterov momentum");
+		AssertAprox(w_adam(i), wa, "Adam");
+		AssertAprox(w_adamw(i), ww, "AdamW decayed weight");
+		AssertAprox(b_adamw(i), wa, "AdamW parameter without decay");
+	}
 }
 
 void testAllOps() {
@@ -294,9 +605,17 @@ void testAllOps() {
 		testSoftMax(size, batch, &device);
 		testSigmoid(size, batch, &device);
 		testTanh(size, batch, &device);
+		testReLUFamily(size, batch, &device);
+		testSaturatingFromAct(size, batch, &device);
 
 		testMSE(size, batch, &device);
 		testCrossEntropy(size, batch, &device);
+		testSoftmaxCrossEntropy(size, batch, &device);
+		testCountCorrect(size, batch, &device);
+		testGather(size, batch, &device);
+		testQuantization(size, batch, &device);
+		testSparse(size, batch, &device);
+		testOptimizers(3000, &device);
 		std::cout << "Sucess\n";
 }
 
@@ -1,6 +1,7 @@
 #ifndef TEST_H
 #define TEST_H
 
+#include <cstdint>
 #include <filesystem>
 #include "timer.h"
 #include "sequential.h"
@@ -8,9 +9,96 @@
 #include "utils.h"
 #include "batchPNGReader.h"
 #include "batchCSVReader.h"
+#include "testOps.h"
+#include "static_sequential.h"
+#include "inference.h"
 
 namespace fs = std::filesystem;
 
+// Derivative of loss() in parameter i by fourth order central differences,
+// so the truncation error stays below float gradient check tolerances
+template<typename F>
+float numeric_gradient(TensorMap<Tensor<float, 1>>& params, Index i, float h, F&& loss){
+    const float p = params(i);
+    auto at = [&](float value){
+        params(i) = value;
+        return static_cast<double>(loss());
+    };
+    const double near = at(p + h) - at(p - h);
+    const double far = at(p + 2 * h) - at(p - 2 * h);
+    params(i) = p;
+    return static_cast<float>((8 * near - far) / (12 * h));
+}
+
+// grads against numeric_gradient element by element. The loss of models
+// storing convolutional activations as bfloat16 (NNN_MIXED_PRECISION) is
+// only smooth at a coarser scale, there the whole vector has to agree for
+// a larger step
+template<typename F>
+void check_gradients(const Tensor<float, 1>& grads, TensorMap<Tensor<float, 1>>& params, 
+    float h, float tolerance, F&& loss, const std::string& name){
+    constexpr bool narrow = sizeof(storage_t) < sizeof(float);
+    if constexpr (narrow){
+        h = std::max(h, 3e-2f);
+    }
+    Tensor<float, 1> numeric(params.size());
+    for(Index i{0}; i < params.size(); i++){
+        numeric(i) = numeric_gradient(params, i, h, loss);
+    }
+    if constexpr (narrow){
+        Tensor<float, 0> err = (numeric - grads).square().sum().sqrt();
+        Tensor<float, 0> norm = numeric.square().sum().sqrt();
+        ASSERT_WITH_MSG(err(0) < 0.1f * norm(0), 
+            name + " gradient relative error " + std::to_string(err(0) / norm(0)));
+        return;
+    }
+    for(Index i{0}; i < params.size(); i++){
+        ASSERT_WITH_MSG(std::abs(numeric(i) - grads(i)) < tolerance * std::max(1.0f, std::abs(numeric(i))),
+            name + " gradient " + std::to_string(i));
+    }
+}
+
+// Batches held in memory behind the interface of the file readers
+template<size_t in_dims>
+class MemoryReader
+{
+public:
+    typedef Tensor<float, in_dims + 1> out_data_t;
+    typedef Tensor<float, 2> out_label_t;
+    typedef std::pair<out_data_t, out_label_t> batch_t;
+
+    struct iterator
+    {
+        batch_t* _batch;
+        iterator& operator++(){ _batch++; return *this; }
+        iterator operator++(int){ iterator old = *this; _batch++; return old; }
+        friend bool operator!=(const iterator& a, const iterator& b){ return a._batch != b._batch; }
+        out_data_t& data(){ return _batch->first; }
+        out_label_t& labels(){ return _batch->second; }
+    };
+private:
+    std::vector<batch_t> _batches;
+    Index _batch;
+public:
+    // x and y are split into consecutive batches, a last partial one is dropped
+    MemoryReader(const out_data_t& x, const out_label_t& y, Index batch)
+        :_batch{batch}{
+        Eigen::DSizes<Index, in_dims + 1> offsets, extents = x.dimensions();
+        offsets.fill(0);
+        extents.back() = batch;
+        for(Index j{0}; j + batch <= x.dimension(in_dims); j += batch){
+            offsets.back() = j;
+            _batches.emplace_back(x.slice(offsets, extents),
+                y.slice(Eigen::DSizes<Index, 2>{0, j}, Eigen::DSizes<Index, 2>{y.dimension(0), batch}));
+        }
+    }
+    void reset(){}
+    Index batch() const { return _batch; }
+    Index size() const { return static_cast<Index>(_batches.size()) * _batch; }
+    iterator begin(){ return iterator{_batches.data()}; }
+    iterator end(){ return iterator{_batches.data() + _batches.size()}; }
+};
+
 void testSequentialInit(){
     Sequential2 model({
         new SigmoidLayer(30), 
@@ -23,6 +111,13 @@ void testSequentialInit(){
 
     size_t n_samples = 10;
     model.init(n_samples);
+    // every weight, bias and gradient starts on a 64-byte boundary
+    for(const Parameter& p : model.parameters()){
+        ASSERT_WITH_MSG(reinterpret_cast<std::uintptr_t>(p.value.data) % 64 == 0, 
+            "Parameter not 64-byte aligned");
+        ASSERT_WITH_MSG(reinterpret_cast<std::uintptr_t>(p.grad.data) % 64 == 0, 
+            "Gradient not 64-byte aligned");
+    }
     std::cout << "Success\n\n";
 }
 
@@ -76,6 +171,765 @@ void testBackProp(){
     std::cout << "Success\n\n";
 }
 
+// A batch passed as a temporary, as readers' expressions are, is still
+// there when bkwProp reads the first layer's input
+void testTemporaryInput(){
+    std::array<Index, 1> in_shape{ 12 };
+    std::array<Index, 1> out_shape{ 3 };
+    auto make_model = [&](){
+        return new Sequential2({
+            new SigmoidLayer(6),
+            new SigmoidLayer(3)
+            },
+            in_shape,
+            out_shape,
+            new MSE()
+        );
+    };
+    const int n_samples{ 4 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+
+    Sequential2<1, 1>* named = make_model();
+    Sequential2<1, 1>* temporary = make_model();
+    temporary->param_buffer() = named->param_buffer();
+    named->init(n_samples);
+    temporary->init(n_samples);
+    named->fwdProp(x);
+    named->bkwProp(y);
+    temporary->fwdProp(x * 1.0f);
+    // reuses freed memory of the same size if the batch was not kept
+    Eigen::Tensor<float, 2> overwrite(in_shape[0], n_samples);
+    overwrite.setConstant(100.0f);
+    temporary->bkwProp(y);
+
+    Eigen::Tensor<float, 0> diff = (named->grad_buffer() - temporary->grad_buffer()).abs().maximum();
+    AssertAprox(diff(0), 0.0f, "Temporary input");
+    delete named;
+    delete temporary;
+    std::cout << "Success\n\n";
+}
+
+void testGradientAccumulation(){
+    std::array<Index, 1> in_shape{ 36 };
+    std::array<Index, 1> out_shape{ 3 };
+    auto make_model = [&](){
+        return new Sequential2({
+            new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+            new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+            new FlattenLayer(),
+            new SigmoidLayer(5),
+            new SigmoidLayer(3)
+            },
+            in_shape,
+            out_shape,
+            new MSE()
+        );
+    };
+    const int n_samples{ 4 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+
+    // one step over a batch of 4 against two accumulated batches of 2
+    Sequential2<1, 1>* full = make_model();
+    Sequential2<1, 1>* accumulated = make_model();
+    accumulated->param_buffer() = full->param_buffer();
+    Eigen::Tensor<float, 1> initial = full->param_buffer();
+    optim::SGD full_optimizer(0.5f, 0.0f);
+    optim::SGD accumulated_optimizer(0.5f, 0.0f);
+    full->train(x, y, 1, 4, full_optimizer, x, y);
+    accumulated->accumulate(2);
+    accumulated->train(x, y, 1, 2, accumulated_optimizer, x, y);
+
+    Eigen::Tensor<float, 0> diff = (full->param_buffer() - accumulated->param_buffer()).abs().maximum();
+    AssertAprox(diff(0), 0.0f, "Accumulated gradients");
+    Eigen::Tensor<float, 0> moved = (full->param_buffer() - initial).abs().maximum();
+    ASSERT_WITH_MSG(moved(0) > 0.0f, "Accumulated training did not move the parameters");
+    delete full;
+    delete accumulated;
+    std::cout << "Success\n\n";
+}
+
+void testActivationCheckpointing(){
+    std::array<Index, 1> in_shape{ 36 };
+    std::array<Index, 1> out_shape{ 3 };
+    auto make_model = [&](){
+        return new Sequential2({
+            new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+            new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+            new PoolingLayer(std::array<Index, 2>({2, 2}), 1),
+            new FlattenLayer(),
+            new SigmoidLayer(12),
+            new TanhLayer(12),
+            new SigmoidLayer(12),
+            new TanhLayer(12),
+            new SigmoidLayer(3)
+            },
+            in_shape,
+            out_shape,
+            new CrossEntropy(true)
+        );
+    };
+    const int n_samples{ 5 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setZero();
+    for(int j{0}; j < n_samples; j++){
+        y(j % 3, j) = 1.0f;
+    }
+
+    Sequential2<1, 1>* plain = make_model();
+    plain->init(n_samples);
+    plain->fwdProp(x);
+    const size_t plain_bytes = plain->memory_report().total(mem::Role::Activation);
+    plain->bkwProp(y);
+
+    std::vector<std::vector<size_t>> policies{ {}, {3}, {2, 8} };
+    for(size_t p{0}; p < policies.size(); p++){
+        Sequential2<1, 1>* recomputed = make_model();
+        recomputed->param_buffer() = plain->param_buffer();
+        if(policies[p].empty()){
+            recomputed->checkpoint_activations();
+        }else{
+            recomputed->checkpoint_activations(policies[p]);
+        }
+        recomputed->init(n_samples);
+        recomputed->fwdProp(x);
+        ASSERT_WITH_MSG(recomputed->memory_report().total(mem::Role::Activation) < plain_bytes,
+            "Checkpointing does not save activation memory");
+        recomputed->bkwProp(y);
+
+        Eigen::Tensor<float, 0> diff = (plain->grad_buffer() - recomputed->grad_buffer()).abs().maximum();
+        AssertAprox(diff(0), 0.0f, "Recomputed gradients");
+        Eigen::Tensor<float, 0> out_diff = (plain->output(n_samples) - recomputed->output(n_samples)).abs().maximum();
+        AssertAprox(out_diff(0), 0.0f, "Checkpointed output");
+        delete recomputed;
+    }
+    delete plain;
+    std::cout << "Success\n\n";
+}
+
+void testBatchNorm(){
+    std::array<Index, 1> in_shape{ 36 };
+    std::array<Index, 1> out_shape{ 3 };
+    Sequential2 model({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+        new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+        new BatchNormLayer<4>(),
+        new FlattenLayer(),
+        new SigmoidLayer(6),
+        new BatchNormLayer<1>(),
+        new TanhLayer(5),
+        new SigmoidLayer(3)
+        },
+        in_shape,
+        out_shape,
+        new MSE()
+    );
+    const int n_samples{ 4 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+    model.init(n_samples);
+    for(BaseLayer* layer : {model.layers()[3], model.layers()[6]}){
+        for(const Parameter& p : layer->parameters()){
+            TensorWrapper<float>(p.value).get().setRandom();
+        }
+    }
+
+    // gradients with batch statistics against central differences of 
+    // the MSE loss 0.5 * |a - y|^2
+    auto loss = [&](){
+        model.fwdProp(x);
+        Eigen::Tensor<float, 0> l = (model.output(n_samples) - y).square().sum() * 0.5f;
+        return l(0);
+    };
+    model.training(true);
+    model.fwdProp(x);
+    model.bkwProp(y);
+    Eigen::Tensor<float, 1> grads = model.grad_buffer();
+    auto params = model.param_buffer();
+    check_gradients(grads, params, 3e-3f, 2e-3f, loss, "Batch norm");
+
+    // running statistics out of training, then folded into the fully
+    // connected layers after both batch norms
+    model.training(false);
+    model.fwdProp(x);
+    Eigen::Tensor<float, 2> expected = model.output(n_samples);
+    ASSERT_WITH_MSG(model.fold_batch_norm() == 2, "Batch norm layers not folded");
+    model.fwdProp(x);
+    Eigen::Tensor<float, 0> diff = (model.output(n_samples) - expected).abs().maximum();
+    AssertAprox(diff(0), 0.0f, "Folded batch norm");
+    std::cout << "Success\n\n";
+}
+
+// ReLU layers after a convolution and fully connected ones, gradients of 
+// the smooth GELU against central differences
+void testReLULayers(){
+    std::array<Index, 1> in_shape{ 36 };
+    std::array<Index, 1> out_shape{ 3 };
+    Sequential2 model({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+        new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+        new ActivationLayer<activation::GELU, 4>(),
+        new FlattenLayer(),
+        new GELULayer(6),
+        new SigmoidLayer(3)
+        },
+        in_shape,
+        out_shape,
+        new MSE()
+    );
+    const int n_samples{ 4 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+    model.init(n_samples);
+    auto loss = [&](){
+        model.fwdProp(x);
+        Eigen::Tensor<float, 0> l = (model.output(n_samples) - y).square().sum() * 0.5f;
+        return l(0);
+    };
+    model.fwdProp(x);
+    model.bkwProp(y);
+    Eigen::Tensor<float, 1> grads = model.grad_buffer();
+    auto params = model.param_buffer();
+    check_gradients(grads, params, 1e-2f, 2e-3f, loss, "GELU");
+
+    // ReLU family layers train, the fully connected ones keep no
+    // weighted inputs
+    Sequential2 relu({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+        new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+        new ActivationLayer<activation::ReLU, 4>(),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 1),
+        new FlattenLayer(),
+        new ReLULayer(8),
+        new LeakyReLULayer(3, 0.1f)
+        },
+        in_shape,
+        out_shape,
+        new MSE()
+    );
+    relu.init(n_samples);
+    const mem::MemoryReport report = relu.memory_report();
+    for(const mem::MemoryReport::Entry& e : report.entries()){
+        // deltas only, no weighted inputs stash
+        if(e.owner == "6 Fully Connected Layer" && e.role == mem::Role::Scratch){
+            ASSERT_WITH_MSG(e.bytes == 8 * n_samples * sizeof(float), "ReLU layer stashes its weighted inputs");
+        }
+    }
+    auto relu_loss = [&](){
+        relu.init(n_samples);
+        relu.fwdProp(x);
+        Eigen::Tensor<float, 0> l = (relu.output(n_samples) - y).square().sum();
+        return l(0);
+    };
+    const float before = relu_loss();
+    optim::SGD optimizer(0.02f);
+    relu.train(x, y, 20, n_samples, optimizer, x, y);
+    ASSERT_WITH_MSG(relu_loss() < before, "Training the ReLU network does not lower its loss");
+    std::cout << "Success\n\n";
+}
+
+// The weighted inputs GELU layers stash are storage_t (bfloat16 with
+// NNN_MIXED_PRECISION), layers deriving from their activations stash none.
+// Gradients against central differences, looser when stashed in bfloat16.
+// Convolution, pooling, activation and batch norm layers store their
+// activations and gradients as storage_t, halving a CNN's activations
+void testMixedPrecision(){
+    std::array<Index, 1> in_shape{ 8 };
+    std::array<Index, 1> out_shape{ 3 };
+    Sequential2 model({
+        new GELULayer(6),
+        new SigmoidLayer(5),
+        new GELULayer(3)
+        },
+        in_shape,
+        out_shape,
+        new MSE()
+    );
+    const int n_samples{ 4 };
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+    model.init(n_samples);
+
+    const std::vector<BaseLayer*>& layers = model.layers();
+    ASSERT_WITH_MSG(layers[1]->memory().scratch == 6 * n_samples * (sizeof(storage_t) + sizeof(float)),
+        "GELU stash is not storage_t");
+    ASSERT_WITH_MSG(layers[2]->memory().scratch == 5 * n_samples * sizeof(float),
+        "Sigmoid layer stashes its weighted inputs");
+
+    auto loss = [&](){
+        model.fwdProp(x);
+        Eigen::Tensor<float, 0> l = (model.output(n_samples) - y).square().sum() * 0.5f;
+        return l(0);
+    };
+    model.fwdProp(x);
+    model.bkwProp(y);
+    Eigen::Tensor<float, 1> grads = model.grad_buffer();
+    auto params = model.param_buffer();
+    const float h{ 1e-2f };
+    const float tolerance = sizeof(storage_t) < sizeof(float) ? 2e-2f : 2e-3f;
+    for(Index i{0}; i < params.size(); i++){
+        const float numeric = numeric_gradient(params, i, h, loss);
+        ASSERT_WITH_MSG(std::abs(numeric - grads(i)) < tolerance * std::max(1.0f, std::abs(numeric)),
+            "Mixed precision gradient " + std::to_string(i));
+    }
+
+    std::array<Index, 1> image_shape{ 144 };
+    Sequential2 cnn({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 12, 12, 1})),
+        new ConvolLayer(std::array<Index, 3>({4, 3, 3})),
+        new ActivationLayer<activation::ReLU, 4>(),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 2),
+        new BatchNormLayer<4>(),
+        new FlattenLayer(),
+        new SigmoidLayer(3)
+        },
+        image_shape,
+        out_shape,
+        new MSE()
+    );
+    Eigen::Tensor<float, 2> images(image_shape[0], n_samples);
+    images.setRandom();
+    cnn.init(n_samples);
+    // [1, 10, 10, 4] after the convolution and the ReLU, [1, 5, 5, 4]
+    // after pooling and batch norm. Gradients are input sized
+    const size_t conv_elements = n_samples * (2 * 400 + 2 * 100);
+    const size_t grad_elements = n_samples * (144 + 2 * 400 + 100);
+    size_t conv_bytes{ 0 }, grad_bytes{ 0 };
+    for(Index i : {2, 3, 4, 5}){
+        const LayerMemory m = cnn.layers()[i]->memory();
+        conv_bytes += m.activation;
+        grad_bytes += m.gradient - m.weights;
+    }
+    ASSERT_WITH_MSG(conv_bytes == conv_elements * sizeof(storage_t), 
+        "Convolutional activations are not storage_t");
+    ASSERT_WITH_MSG(grad_bytes == grad_elements * sizeof(storage_t), 
+        "Convolutional gradients are not storage_t");
+    const size_t activations = cnn.memory_report().total(mem::Role::Activation);
+    const size_t as_float = activations + conv_elements * (sizeof(float) - sizeof(storage_t));
+    if(sizeof(storage_t) < sizeof(float)){
+        ASSERT_WITH_MSG(activations < 0.6 * as_float, 
+            "Mixed precision does not halve the activations");
+    }
+    std::cout << "Success\n\n";
+}
+
+void testCheckpoint(){
+    std::array<Index, 1> in_shape{ 4 };
+    std::array<Index, 1> out_shape{ 3 };
+    auto make_model = [&](){
+        return new Sequential2({
+            new SigmoidLayer(5), 
+            new SigmoidLayer(3)
+            },
+            in_shape,
+            out_shape,
+            new MSE()
+        );
+    };
+    Sequential2<1, 1>* model = make_model();
+    int n_samples {6};
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+
+    optim::Adam optimizer(0.01f);
+    model->train(x, y, 2, 2, optimizer, x, y);
+    std::string path = (fs::temp_directory_path() / "nnn_checkpoint.bin").string();
+    model->save(path, &optimizer);
+
+    for(bool in_place : {false, true}){
+        Sequential2<1, 1>* loaded = make_model();
+        optim::Adam loaded_optimizer(0.01f);
+        loaded->load(path, &loaded_optimizer, in_place);
+        Eigen::Tensor<float, 0> diff = (model->param_buffer() - loaded->param_buffer()).abs().maximum();
+        AssertAprox(diff(0), 0.0f, "Checkpoint parameters");
+        Eigen::Tensor<float, 0> state_diff = (optimizer.state() - loaded_optimizer.state()).abs().maximum();
+        AssertAprox(state_diff(0), 0.0f, "Checkpoint optimizer state");
+        ASSERT_WITH_MSG(optimizer.steps() == loaded_optimizer.steps(), "Checkpoint steps");
+        // training keeps working on mapped parameters
+        loaded->train(x, y, 1, 2, loaded_optimizer, x, y);
+        delete loaded;
+    }
+
+    // a copy loaded over a mapped checkpoint leaves the optimizer with the
+    // views train() initializes it with, so the restored state is kept
+    Sequential2<1, 1>* reloaded = make_model();
+    optim::Adam reloaded_optimizer(0.01f);
+    reloaded->load(path, &reloaded_optimizer, true);
+    reloaded->load(path, &reloaded_optimizer, false);
+    reloaded_optimizer.init(reloaded->parameters());
+    Eigen::Tensor<float, 0> state_diff = (optimizer.state() - reloaded_optimizer.state()).abs().maximum();
+    AssertAprox(state_diff(0), 0.0f, "Reloaded optimizer state");
+    delete reloaded;
+    delete model;
+    fs::remove(path);
+    std::cout << "Success\n\n";
+}
+
+void testProfiler(){
+    std::array<Index, 1> in_shape{ 36 };
+    std::array<Index, 1> out_shape{ 8 };
+    Sequential2 model({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+        new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 1),
+        new FlattenLayer(),
+        new SigmoidLayer(8)
+        },
+        in_shape,
+        out_shape,
+        new MSE()
+    );
+
+    int n_samples {4};
+    Eigen::Tensor<float, 2> x(in_shape[0], n_samples);
+    Eigen::Tensor<float, 2> y(out_shape[0], n_samples);
+    x.setRandom();
+    y.setRandom();
+
+    model.init(n_samples);
+    model.profiler().enable(true);
+    model.fwdProp(x);
+    model.bkwProp(y);
+    model.profiler().enable(false);
+    model.fwdProp(x);
+
+    // conv, pooling, sigmoid and output, forward and backward; reshape
+    // and flatten are views and the disabled pass is not recorded
+    const auto& events = model.profiler().events();
+    ASSERT_WITH_MSG(events.size() == 8, "Profiler events " + std::to_string(events.size()));
+    for(const Profiler::Event& e : events){
+        ASSERT_WITH_MSG(e.duration_us >= 0.0, "Negative profiler duration");
+    }
+    ASSERT_WITH_MSG(events.front().flops > 0.0, "Profiler event without flops");
+    ASSERT_WITH_MSG(events.front().bytes > 0.0, "Profiler event without bytes");
+    model.profiler().summary(std::cout);
+    std::cout << "Success\n\n";
+}
+
+void testMemoryReport(){
+    const Index n_samples{ 3 };
+    Sequential2 model({
+        new SigmoidLayer(5), 
+        new SigmoidLayer(2)
+        },
+        std::array<Index, 1>{4},
+        std::array<Index, 1>{2},
+        new CrossEntropy(true)
+    );
+    model.init(n_samples);
+    optim::Adam optimizer(0.01f);
+    optimizer.init(model.parameters());
+
+    mem::MemoryReport report = model.memory_report(&optimizer);
+    Index params{ 0 };
+    for(BaseLayer* layer : model.layers()){
+        params += layer->num_params();
+    }
+    // input layer aliases the batch, fully connected and output layers 
+    // hold their activations
+    ASSERT_WITH_MSG(report.total(mem::Role::Activation) == (5 + 2 + 2) * n_samples * sizeof(float),
+        "Memory report activations");
+    ASSERT_WITH_MSG(report.total(mem::Role::Weights) == params * sizeof(float), "Memory report weights");
+    // Adam keeps two moments per parameter
+    Index elements{ 0 };
+    for(const Parameter& p : model.parameters()){
+        elements += p.value._size;
+    }
+    ASSERT_WITH_MSG(report.total(mem::Role::Optimizer) == 2 * elements * sizeof(float),
+        "Memory report optimizer state");
+    ASSERT_WITH_MSG(report.total("0 Input Layer") == 0, "Memory report input layer");
+    if(mem::tracking_allocations){
+        const mem::AllocationCounts before = mem::allocation_counts();
+        Tensor<float, 2> allocated(8, 8);
+        ASSERT_WITH_MSG(mem::allocation_counts().eigen == before.eigen + 1,
+            "Eigen allocation not counted");
+    }
+    std::cout << report;
+    std::cout << "Success\n\n";
+}
+
+void testInferenceEngine(){
+    const int n_clients{ 3 };
+    const int n_requests{ 7 };
+    Sequential2 model({
+        new SigmoidLayer(6), 
+        new SoftMaxLayer(3)
+        },
+        std::array<Index, 1>{4},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    Eigen::Tensor<float, 2> x(4, n_clients * n_requests);
+    x.setRandom();
+
+    std::vector<Eigen::Tensor<float, 1>> results(n_clients * n_requests);
+    size_t batches;
+    {
+        InferenceEngine engine(model, 4, std::chrono::microseconds(500));
+        std::vector<std::thread> clients;
+        for(int c{0}; c < n_clients; c++){
+            clients.emplace_back([&, c](){
+                for(int r{0}; r < n_requests; r++){
+                    const int j = c * n_requests + r;
+                    results[j] = engine.submit(x.chip(j, 1)).get();
+                }
+            });
+        }
+        for(std::thread& client : clients){
+            client.join();
+        }
+        ASSERT_WITH_MSG(engine.stats().requests == n_clients * n_requests, "Inference engine lost requests");
+        batches = engine.stats().batches;
+    }
+
+    model.init(x.dimension(1));
+    model.fwdProp(x);
+    Eigen::Tensor<float, 2> expected = model.output(x.dimension(1));
+    for(Index j{0}; j < x.dimension(1); j++){
+        for(Index i{0}; i < 3; i++){
+            AssertAprox(results[j](i), expected(i, j), "inference engine");
+        }
+    }
+    std::cout << n_clients * n_requests << " requests in " << batches << " batches\n";
+    std::cout << "Success\n\n";
+}
+
+void testExecutionContext(){
+    const int n_threads{ 4 };
+    const Index n_samples{ 3 };
+    Sequential2 model({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 6, 6, 1})),
+        new ConvolLayer(std::array<Index, 3>({2, 3, 3})),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 1),
+        new FlattenLayer(),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{36},
+        std::array<Index, 1>{3},
+        new CrossEntropy(true)
+    );
+
+    // every thread predicts its own batch, expected from the model itself
+    std::vector<Eigen::Tensor<float, 2>> inputs(n_threads);
+    std::vector<Eigen::Tensor<float, 2>> expected(n_threads);
+    model.init(n_samples);
+    for(int t{0}; t < n_threads; t++){
+        inputs[t] = Eigen::Tensor<float, 2>(36, n_samples);
+        inputs[t].setRandom();
+        model.fwdProp(inputs[t]);
+        expected[t] = model.output(n_samples);
+    }
+
+    std::vector<int> mismatches(n_threads, 0);
+    std::vector<std::thread> threads;
+    for(int t{0}; t < n_threads; t++){
+        threads.emplace_back([&, t](){
+            auto context = model.context();
+            for(int r{0}; r < 50; r++){
+                context.fwdProp(inputs[t]);
+                auto out = context.output();
+                for(Index j{0}; j < n_samples; j++){
+                    for(Index i{0}; i < 3; i++){
+                        mismatches[t] += std::abs(out(i, j) - expected[t](i, j)) > 1e-5f;
+                    }
+                }
+            }
+        });
+    }
+    for(std::thread& thread : threads){
+        thread.join();
+    }
+    for(int t{0}; t < n_threads; t++){
+        ASSERT_WITH_MSG(mismatches[t] == 0, "Execution context " + std::to_string(t) + " disagrees with the model");
+    }
+    std::cout << "Success\n\n";
+}
+
+void testStaticSequential(){
+    const Index n_samples{ 3 };
+    Sequential2 model({
+        new SigmoidLayer(5), 
+        new TanhLayer(6),
+        new SoftMaxLayer(3)
+        },
+        std::array<Index, 1>{4},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    StaticSequential<4, n_samples, 
+        StaticDense<4, 5>, StaticSigmoid, 
+        StaticDense<5, 6>, StaticTanh, 
+        StaticDense<6, 3>, StaticSoftMax> fixed;
+    fixed.load(model.layers());
+
+    Eigen::Tensor<float, 2> x(4, n_samples);
+    x.setRandom();
+    model.init(n_samples);
+    model.fwdProp(x);
+    Eigen::Tensor<float, 2> expected = model.output(n_samples);
+    const auto& out = fixed.forward(x.data());
+    for(Index j{0}; j < n_samples; j++){
+        for(Index i{0}; i < 3; i++){
+            AssertAprox(out(i, j), expected(i, j), "static sequential");
+        }
+    }
+
+    // layers without a static counterpart are refused instead of being
+    // read as dense ones: other activations and unfolded batch norm
+    auto throws = [](auto&& f){
+        try{
+            f();
+        }catch(const std::runtime_error&){
+            return true;
+        }
+        return false;
+    };
+    typedef StaticSequential<4, n_samples, StaticDense<4, 5>, StaticSigmoid, 
+        StaticDense<5, 3>, StaticSigmoid> sigmoid_t;
+    Sequential2 relu({
+        new ReLULayer(5),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{4},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    ASSERT_WITH_MSG(throws([&](){ sigmoid_t().load(relu.layers()); }), 
+        "ReLU layer loaded into a StaticSigmoid network");
+    Sequential2 normalized({
+        new SigmoidLayer(5),
+        new BatchNormLayer<1>(),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{4},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    ASSERT_WITH_MSG(throws([&](){ sigmoid_t().load(normalized.layers()); }), 
+        "Batch norm layer loaded as a dense one");
+    normalized.init(n_samples);
+    normalized.fold_batch_norm();
+    sigmoid_t folded;
+    folded.load(normalized.layers());
+    normalized.fwdProp(x);
+    expected = normalized.output(n_samples);
+    const auto& folded_out = folded.forward(x.data());
+    for(Index j{0}; j < n_samples; j++){
+        for(Index i{0}; i < 3; i++){
+            AssertAprox(folded_out(i, j), expected(i, j), "folded static sequential");
+        }
+    }
+    std::cout << "Success\n\n";
+}
+
+// Images of 8x8 with a bright band whose position gives the class
+void quantization_data(Tensor<float, 2>& x, Tensor<float, 2>& y){
+    const Index n = x.dimension(1), classes = y.dimension(0);
+    x.setRandom();
+    x = x * 0.3f;
+    y.setZero();
+    for(Index j{0}; j < n; j++){
+        const Index c = j % classes;
+        for(Index col{0}; col < 8; col++){
+            for(Index row{2 * c + 1}; row < 2 * c + 3; row++){
+                x(row + 8 * col, j) += 1.0f;
+            }
+        }
+        y(c, j) = 1.0f;
+    }
+}
+
+// Trains model, quantizes it with quant::quantize and checks the int8
+// forward pass against the float one
+template<class model_t>
+void check_quantized(model_t& model, const std::string& name){
+    const Index n{ 96 }, batch{ 16 }, classes{ 3 };
+    Tensor<float, 2> x(64, n), y(classes, n);
+    quantization_data(x, y);
+    optim::Adam optimizer(0.01f);
+    model.train(x, y, 30, batch, optimizer, x, y);
+
+    MemoryReader<1> reader(x, y, batch);
+    quant::QuantizedModel qmodel = quant::quantize(model, reader, 4);
+    ASSERT_WITH_MSG(qmodel.in_size() == 64 && qmodel.out_size() == classes,
+        name + " quantized model shape");
+    model.init(n);
+    model.fwdProp(x);
+    Tensor<float, 2> expected = model.output(n);
+    Tensor<float, 2> quantized = qmodel.fwd(x.data(), n, model.device());
+    Tensor<float, 0> diff = (expected - quantized).abs().maximum();
+    ASSERT_WITH_MSG(diff(0) < 2e-2f, name + " int8 output differs by " + std::to_string(diff(0)));
+
+    const quant::Report report = quant::compare(model, qmodel, reader);
+    ASSERT_WITH_MSG(report.float_accuracy > 0.9f, name + " did not train");
+    ASSERT_WITH_MSG(std::abs(report.int8_accuracy - report.float_accuracy) < 0.05f,
+        name + " int8 accuracy delta");
+    ASSERT_WITH_MSG(report.int8_bytes < report.float_bytes, name + " int8 weights size");
+    std::cout << report;
+}
+
+void testQuantizedModel(){
+    Sequential2 cnn({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 8, 8, 1})),
+        // rectangular kernels, the second convolution sees two depths
+        new ConvolLayer(std::array<Index, 3>({2, 3, 2})),
+        new ConvolLayer(std::array<Index, 3>({2, 2, 3})),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 2),
+        new FlattenLayer(),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{64},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    check_quantized(cnn, "Conv+Pool+FC");
+
+    // element-wise activations after a convolution. ReLU commutes with
+    // max pooling, GELU does not, so it also shows a skipped activation
+    Sequential2 relu_cnn({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 8, 8, 1})),
+        new ConvolLayer(std::array<Index, 3>({3, 3, 3})),
+        new ActivationLayer<activation::ReLU, 4>(),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 2),
+        new FlattenLayer(),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{64},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    check_quantized(relu_cnn, "Conv+ReLU+Pool+FC");
+    Sequential2 gelu_cnn({
+        new ReshapeLayer<1, 4>(std::array<Index, 4>({1, 8, 8, 1})),
+        new ConvolLayer(std::array<Index, 3>({3, 3, 3})),
+        new ActivationLayer<activation::GELU, 4>(),
+        new PoolingLayer(std::array<Index, 2>({2, 2}), 2),
+        new FlattenLayer(),
+        new SigmoidLayer(3)
+        },
+        std::array<Index, 1>{64},
+        std::array<Index, 1>{3},
+        new MSE()
+    );
+    check_quantized(gelu_cnn, "Conv+GELU+Pool+FC");
+    std::cout << "Success\n\n";
+}
+
 void testReadBatchPNG(std::string& data_dir) {
     typedef BatchPNGReader::out_data_t data_t;
     typedef BatchPNGReader::out_label_t label_t;
@@ -103,7 +957,7 @@ void testReadBatchPNG(std::string& data_dir) {
     for(;begin!=end;begin++){
         n++;
     }
-    assert(n == (n_images / batch_size));
+    ASSERT_WITH_MSG(n == (n_images / batch_size), "Reader batch count");
     begin--;
     label_batch = begin.labels();
     image_batch = begin.data();
@@ -144,7 +998,7 @@ void testReadBatchCSV(std::string& data_dir) {
     for(;begin!=end;begin++){
         n++;
     }
-    assert(n == (n_images / batch_size));
+    ASSERT_WITH_MSG(n == (n_images / batch_size), "Reader batch count");
     begin--;
     label_batch = begin.labels();
     image_batch = begin.data();